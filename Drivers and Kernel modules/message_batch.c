@@ -0,0 +1,137 @@
+/*
+ * message_batch.c
+ *
+ * Compares fanning a message out to many channels one message at a time (MSG_SLOT_WRITE_MODE, MSG_SLOT_CHANNEL and
+ * write for each, like message_sender) with one MSG_SLOT_BATCH_WRITE ioctl, and collecting them with
+ * MSG_SLOT_CHANNEL and read for each against one MSG_SLOT_BATCH_READ.
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path.
+ * 2. argv[2] – optional, the number of channels to fan out to (default 64, at most MSG_SLOT_MAX_BATCH).
+ * 3. argv[3] – optional, the number of rounds (default 10000).
+ * 4. argv[4] – optional, the first channel id to use (default 1).
+ * The flow:
+ * Every round sends one message to each of the channels, then reads them all back and checks them, first with single
+ * calls and then with batches.
+ * Prints a CSV header and one line per method and direction: method,op,channels,messages,ns_per_message
+ * Exit value is 0 on success and a non-zero value on error.
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "message_slot.h"
+
+long long now_ns();
+
+int main (int argc, char* argv[]){
+	int fd, channels = 64, rounds = 10000, r, i, method;
+	unsigned int first = 1;
+	char msgs[MSG_SLOT_MAX_BATCH][16], bufs[MSG_SLOT_MAX_BATCH][BUF_LEN];
+	int lens[MSG_SLOT_MAX_BATCH];
+	struct msg_slot_batch_entry w[MSG_SLOT_MAX_BATCH], rd[MSG_SLOT_MAX_BATCH];
+	struct msg_slot_batch wb, rb;
+	long long t, wns, rns;
+	if (argc<2){
+		puts("This function demands at least 1 argument: <slot file> [channels] [rounds] [first channel]");
+		return -1;
+	}
+	if (argc>2 && atoi(argv[2])>0 && atoi(argv[2])<=MSG_SLOT_MAX_BATCH){
+		channels = atoi(argv[2]);
+	}
+	if (argc>3 && atoi(argv[3])>0){
+		rounds = atoi(argv[3]);
+	}
+	if (argc>4 && atoi(argv[4])>0){
+		first = atoi(argv[4]);
+	}
+	fd = open(argv[1],O_RDWR | O_NONBLOCK);
+	if (fd<0){
+		printf("Error opening file. errno: %d\n",errno);
+		return -1;
+	}
+	for (i=0 ; i<channels ; i++){
+		lens[i] = snprintf(msgs[i], sizeof(msgs[i]), "message %d", i);
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].channel = first + i;
+		w[i].buf = (unsigned long)msgs[i];
+		w[i].length = lens[i];
+		memset(&rd[i], 0, sizeof(rd[i]));
+		rd[i].channel = first + i;
+		rd[i].buf = (unsigned long)bufs[i];
+		rd[i].length = BUF_LEN;
+	}
+	wb.entries = (unsigned long)w;
+	rb.entries = (unsigned long)rd;
+	wb.count = rb.count = channels;
+	wb.pad = rb.pad = 0;
+	printf("method,op,channels,messages,ns_per_message\n");
+	for (method=0 ; method<2 ; method++){ //0 single calls, 1 batches
+		wns = rns = 0;
+		for (r=0 ; r<rounds ; r++){
+			memset(bufs, 0, sizeof(bufs));
+			t = now_ns();
+			if (method==1){
+				if (ioctl(fd, MSG_SLOT_BATCH_WRITE, &wb)!=channels){
+					printf("Batch write error, errno: %d, first result %d\n",errno,w[0].result);
+					close(fd);
+					return -1;
+				}
+			}
+			else{
+				for (i=0 ; i<channels ; i++){
+					if (ioctl(fd, MSG_SLOT_WRITE_MODE, 0)!=0 || ioctl(fd, MSG_SLOT_CHANNEL, first + i)!=0 ||
+							write(fd, msgs[i], lens[i])!=lens[i]){
+						printf("Write error, errno: %d\n",errno);
+						close(fd);
+						return -1;
+					}
+				}
+			}
+			wns += now_ns() - t;
+			t = now_ns();
+			if (method==1){
+				if (ioctl(fd, MSG_SLOT_BATCH_READ, &rb)!=channels){
+					printf("Batch read error, errno: %d, first result %d\n",errno,rd[0].result);
+					close(fd);
+					return -1;
+				}
+			}
+			else{
+				for (i=0 ; i<channels ; i++){
+					if (ioctl(fd, MSG_SLOT_CHANNEL, first + i)!=0 || read(fd, bufs[i], BUF_LEN)!=lens[i]){
+						printf("Read error, errno: %d\n",errno);
+						close(fd);
+						return -1;
+					}
+				}
+			}
+			rns += now_ns() - t;
+			for (i=0 ; i<channels ; i++){
+				if (memcmp(bufs[i], msgs[i], lens[i])){
+					printf("Channel %u returned \"%.*s\" instead of \"%s\"\n",first + i,lens[i],bufs[i],msgs[i]);
+					close(fd);
+					return -1;
+				}
+			}
+		}
+		printf("%s,write,%d,%lld,%.1f\n",method ? "batch" : "single",channels,(long long)channels*rounds,
+				(double)wns/channels/rounds);
+		printf("%s,read,%d,%lld,%.1f\n",method ? "batch" : "single",channels,(long long)channels*rounds,
+				(double)rns/channels/rounds);
+	}
+	close(fd);
+	return 0;
+}
+
+long long now_ns(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
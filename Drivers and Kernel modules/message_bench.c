@@ -0,0 +1,91 @@
+/*
+ * message_bench.c
+ *
+ * Microbenchmark of the channel switch (MSG_SLOT_CHANNEL ioctl) cost against the number of channels in a slot.
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path. Use a fresh slot: channels created here stay until the module is unloaded.
+ * 2. argv[2] – optional, the maximal number of channels (default 65536).
+ * 3. argv[3] – optional, the number of switches timed at each channel count (default 100000).
+ * The flow:
+ * 1. Open the specified message slot device file.
+ * 2. For channel counts 1, 2, 4, ... up to the maximum: create the missing channels (channel ids 1..count),
+ *    then time switches to random channels among them.
+ * 3. Print one CSV line per channel count: channels,switches,ns_per_switch
+ * Exit value is 0 on success and a non-zero value on error.
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "message_slot.h"
+
+
+int main (int argc, char* argv[]){
+	int fd, i;
+	unsigned int max = 65536, switches = 100000, count, made = 0;
+	unsigned int* order;
+	struct timespec start, end;
+	double ns;
+	if (argc<2){
+		puts("This function demands at least 1 argument: <slot file> [max channels] [switches]");
+		return -1;
+	}
+	if (argc>2 && atoi(argv[2])>0){
+		max = atoi(argv[2]);
+	}
+	if (argc>3 && atoi(argv[3])>0){
+		switches = atoi(argv[3]);
+	}
+	fd = open(argv[1],O_RDWR);
+	if (fd<0){
+		printf("Error opening file. errno: %d\n",errno);
+		return -1;
+	}
+	order = malloc(switches*sizeof(unsigned int));
+	if (order==NULL){
+		close(fd);
+		puts("Memory allocation error");
+		return -1;
+	}
+	srand(1);
+	printf("channels,switches,ns_per_switch\n");
+	for (count=1 ; ; count = (count*2 > max) ? max : count*2){ //doubling, the last count is max
+		while (made < count){ //channel ids start at 1, 0 is not a valid channel
+			if (ioctl(fd, MSG_SLOT_CHANNEL, made + 1)!=0){
+				printf("ioctel error creating channel %u, errno: %d\n",made + 1,errno);
+				free(order);
+				close(fd);
+				return -1;
+			}
+			made++;
+		}
+		for (i=0 ; i<switches ; i++){ //random order outside of the timed loop
+			order[i] = 1 + rand() % count;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i=0 ; i<switches ; i++){
+			if (ioctl(fd, MSG_SLOT_CHANNEL, order[i])!=0){
+				printf("ioctel error switching to channel %u, errno: %d\n",order[i],errno);
+				free(order);
+				close(fd);
+				return -1;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		printf("%u,%u,%.1f\n",count,switches,ns/switches);
+		if (count==max){
+			break;
+		}
+	}
+	free(order);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * message_ctl.c
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path.
+ * 2. argv[2] – the command: "mem" or "delete".
+ * 3. argv[3] – for delete, the message channel id to remove. Assume a positive integer.
+ * The flow:
+ * - mem: print the number of channels, the memory they take and the limits (MSG_SLOT_MEM).
+ * - delete: remove the channel and its messages (MSG_SLOT_DELETE). Fails with EBUSY while a file uses the channel,
+ *   and with ENOENT if it doesn't exist.
+ * Exit value should be 0 on success and a non-zero value on error.
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "message_slot.h"
+
+
+int main (int argc, char* argv[]){
+	int fd;
+	unsigned long channel = 0;
+	struct msg_slot_mem mem;
+	if (argc<3 || (strcmp(argv[2], "mem") && strcmp(argv[2], "delete")) || (!strcmp(argv[2], "delete") &&
+			(argc<4 || (channel = strtoul(argv[3], NULL, 10))==0))){
+		puts("This function demands 2 arguments: <slot file> mem | <slot file> delete <channel>");
+		return -1;
+	}
+	fd = open(argv[1],O_RDWR);
+	if (fd<0){
+		printf("Error opening file. errno: %d\n",errno);
+		return -1;
+	}
+	if (channel!=0){
+		if (ioctl(fd, MSG_SLOT_DELETE, channel)!=0){
+			close(fd);
+			printf("ioctel error deleting channel %lu, errno: %d%s\n",channel,errno,
+					errno==EBUSY ? " (the channel is in use)" : errno==ENOENT ? " (no such channel)" : "");
+			return -1;
+		}
+		close(fd);
+		printf("Channel %lu of %s deleted\n",channel,argv[1]);
+		return 0;
+	}
+	if (ioctl(fd, MSG_SLOT_MEM, &mem)!=0){
+		close(fd);
+		printf("ioctel error reading memory state, errno: %d\n",errno);
+		return -1;
+	}
+	close(fd);
+	printf("Channels: %llu (%llu in %s), %llu bytes, %llu reclaimed\n",mem.channels,mem.slot_channels,argv[1],
+			mem.bytes,mem.reclaimed);
+	printf("Limits: %llu channels, %llu per slot (0 for none)\n",mem.max_channels,mem.max_slot_channels);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * message_latency.c
+ *
+ * Measures the wakeup latency of a message slot: the time from a write to the moment a waiting reader has the message.
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path.
+ * 2. argv[2] – optional, the mode: "read" (default) or "poll".
+ * 3. argv[3] – optional, the number of samples (default 1000).
+ * 4. argv[4] – optional, the channel id to use (default 1000).
+ * The flow:
+ * A reader thread and the main (writer) thread each open the slot. Every message is the writer's CLOCK_MONOTONIC
+ * time of the write, and the reader subtracts it from its own time once it has read the message.
+ * - read: the reader does a blocking read on the channel, which waits for a message it didn't read yet, and the
+ *   writer writes one once the reader is asleep.
+ * - poll: the reader waits in epoll for a new message on the channel, then reads it.
+ * Prints a CSV header and one line: mode,samples,min_us,median_us,p99_us,max_us
+ * Exit value is 0 on success and a non-zero value on error.
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99 -pthread.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "message_slot.h"
+
+#define SETTLE_US 200 //time for the reader to go to sleep before each write
+
+void* read_loop(void* arg);
+long long now_ns();
+int cmp_ll(const void* a, const void* b);
+
+static int poll_mode, samples = 1000, reader_fd;
+static unsigned int channel = 1000;
+static long long* lat; //latency of each sample in ns
+static volatile int ready, done; //samples the reader is waiting for / has measured
+static volatile int failed;
+
+int main (int argc, char* argv[]){
+	int fd, i;
+	long long ts;
+	pthread_t reader;
+	if (argc<2){
+		puts("This function demands at least 1 argument: <slot file> [read|poll] [samples] [channel]");
+		return -1;
+	}
+	if (argc>2){
+		if (!strcmp(argv[2], "poll")){
+			poll_mode = 1;
+		}
+		else if (strcmp(argv[2], "read")){
+			printf("Unknown mode %s, should be read or poll\n",argv[2]);
+			return -1;
+		}
+	}
+	if (argc>3 && atoi(argv[3])>0){
+		samples = atoi(argv[3]);
+	}
+	if (argc>4 && atoi(argv[4])>0){
+		channel = atoi(argv[4]);
+	}
+	lat = malloc(samples*sizeof(long long));
+	fd = open(argv[1],O_RDWR);
+	reader_fd = open(argv[1],O_RDWR);
+	if (lat==NULL || fd<0 || reader_fd<0){
+		printf("Error opening file. errno: %d\n",errno);
+		return -1;
+	}
+	if (ioctl(fd, MSG_SLOT_WRITE_MODE, 0)!=0 || ioctl(fd, MSG_SLOT_CHANNEL, channel)!=0 ||
+			ioctl(reader_fd, MSG_SLOT_CHANNEL, channel)!=0){
+		printf("ioctel error, errno: %d\n",errno);
+		return -1;
+	}
+	//read a message left by an earlier run, so that only new ones wake the reader
+	fcntl(reader_fd, F_SETFL, O_NONBLOCK);
+	if (read(reader_fd, &ts, sizeof(ts)) < 0 && errno != EWOULDBLOCK){
+		printf("Read error. errno : %d\n",errno);
+		return -1;
+	}
+	fcntl(reader_fd, F_SETFL, 0); //blocking again, a nonblocking read would return the message it already read
+	if (pthread_create(&reader, NULL, read_loop, NULL)){
+		puts("Error creating thread");
+		return -1;
+	}
+	for (i=0 ; i<samples && !failed ; i++){
+		while (ready <= i && !failed){ //reader is not waiting for this sample yet
+			usleep(10);
+		}
+		usleep(SETTLE_US);
+		ts = now_ns();
+		if (write(fd, &ts, sizeof(ts)) != sizeof(ts)){
+			printf("Write error, errno: %d\n",errno);
+			failed = 1;
+			break;
+		}
+		while (done <= i && !failed){ //one write per sample
+			usleep(10);
+		}
+	}
+	pthread_join(reader, NULL);
+	close(fd);
+	close(reader_fd);
+	if (failed){
+		free(lat);
+		return -1;
+	}
+	qsort(lat, samples, sizeof(long long), cmp_ll);
+	printf("mode,samples,min_us,median_us,p99_us,max_us\n");
+	printf("%s,%d,%.1f,%.1f,%.1f,%.1f\n",poll_mode ? "poll" : "read",samples,lat[0]/1e3,lat[samples/2]/1e3,
+			lat[(int)(samples*0.99)]/1e3,lat[samples-1]/1e3);
+	free(lat);
+	return 0;
+}
+
+/*
+ * Reader thread: for each sample announces it is waiting, waits for the message and records its latency.
+ */
+void* read_loop(void* arg){
+	int i, ep = -1;
+	long long ts;
+	struct epoll_event ev;
+	if (poll_mode){
+		ep = epoll_create1(0);
+		ev.events = EPOLLIN;
+		ev.data.fd = reader_fd;
+		if (ep<0 || epoll_ctl(ep, EPOLL_CTL_ADD, reader_fd, &ev)){
+			printf("epoll error, errno: %d\n",errno);
+			failed = 1;
+			return NULL;
+		}
+	}
+	for (i=0 ; i<samples && !failed ; i++){
+		__sync_synchronize();
+		ready = i + 1;
+		if (poll_mode && epoll_wait(ep, &ev, 1, -1) != 1){
+			printf("epoll error, errno: %d\n",errno);
+			failed = 1;
+			break;
+		}
+		if (read(reader_fd, &ts, sizeof(ts)) != sizeof(ts)){ //blocks until the write in read mode
+			printf("Read error. errno : %d\n",errno);
+			failed = 1;
+			break;
+		}
+		lat[i] = now_ns() - ts;
+		__sync_synchronize();
+		done = i + 1;
+	}
+	if (ep>=0){
+		close(ep);
+	}
+	return NULL;
+}
+
+long long now_ns(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int cmp_ll(const void* a, const void* b){
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
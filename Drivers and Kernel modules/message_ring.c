@@ -0,0 +1,74 @@
+/*
+ * message_ring.c
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path.
+ * 2. argv[2] – the target message channel id. Assume a non-negative integer.
+ * 3. argv[3] – optional, the ring depth (number of messages), 0 to go back to a single message.
+ * 4. argv[4] – optional (required with depth > 0), the largest message size in bytes.
+ * 5. argv[5] – optional, "drop" to drop the oldest message when writing to a full ring, instead of failing.
+ * The flow:
+ * 1. Open the specified message slot device file and set the channel id.
+ * 2. If a depth is given, set the ring of the channel (this discards the messages in it).
+ * 3. Print the ring state and counters of the channel.
+ * Exit value should be 0 on success and a non-zero value on error.
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "message_slot.h"
+
+
+int main (int argc, char* argv[]){
+	int fd;
+	unsigned int channel;
+	struct msg_slot_ring conf;
+	struct msg_slot_ring_stats stats;
+	if (argc<3 || (argc>3 && atoi(argv[3])>0 && argc<5)){
+		puts("This function demands 2 arguments: <slot file> <channel> [depth msg_size [drop]]");
+		return -1;
+	}
+	fd = open(argv[1],O_RDWR);
+	if (fd<0){
+		printf("Error opening file. errno: %d\n",errno);
+		return -1;
+	}
+	channel = atoi(argv[2]);
+	if (ioctl(fd, MSG_SLOT_CHANNEL, channel)!=0){
+		close(fd);
+		printf("ioctel error, errno: %d\n",errno);
+		return -1;
+	}
+	if (argc>3){
+		memset(&conf,0,sizeof(conf));
+		conf.depth = atoi(argv[3]);
+		conf.msg_size = argc>4 ? atoi(argv[4]) : 0;
+		conf.flags = (argc>5 && !strcmp(argv[5], "drop")) ? MSG_SLOT_RING_DROP_OLDEST : 0;
+		if (ioctl(fd, MSG_SLOT_RING, &conf)!=0){
+			close(fd);
+			printf("ioctel error setting ring, errno: %d\n",errno);
+			return -1;
+		}
+	}
+	if (ioctl(fd, MSG_SLOT_RING_STATS, &stats)!=0){
+		close(fd);
+		printf("ioctel error reading ring state, errno: %d\n",errno);
+		return -1;
+	}
+	close(fd);
+	if (stats.depth==0){
+		printf("Channel %u of %s holds a single message\n",channel,argv[1]);
+	}
+	else{
+		printf("Channel %u of %s: ring of %u messages of up to %u bytes%s, %u waiting\n",channel,argv[1],stats.depth,
+				stats.msg_size,(stats.flags & MSG_SLOT_RING_DROP_OLDEST) ? " (drops oldest when full)" : "",stats.count);
+	}
+	printf("Overflows: %llu, drops: %llu\n",stats.overflows,stats.drops);
+	return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * message_shm.c
+ *
+ * Sends messages through the shared (mmaped) ring of a message slot channel, from a producer thread to a consumer
+ * thread, and measures throughput, latency and how often the driver had to be entered.
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path.
+ * 2. argv[2] – the target message channel id. Assume a non-negative integer.
+ * 3. argv[3] – optional, the number of messages (default 1000000).
+ * 4. argv[4] – optional, the number of slots, a power of 2 (default 1024). Ignored if the channel already has a ring.
+ * 5. argv[5] – optional, bytes per slot (default 64). Ignored if the channel already has a ring.
+ * The flow:
+ * 1. Create the shared ring of the channel (MSG_SLOT_SHM), unless it exists.
+ * 2. The producer and the consumer each open the slot and map the ring.
+ * 3. The producer writes messages holding a sequence number and its CLOCK_MONOTONIC time, the consumer checks the
+ *    sequence and records the latency. A side that finds the ring empty (full) spins a little, then sets its waiting
+ *    flag and sleeps in poll, and the other side kicks it (MSG_SLOT_SHM_KICK) only when it sees the flag.
+ * 4. Print a CSV header and one line: messages,msgs_per_s,median_us,p99_us,max_us,kicks,sleeps
+ * Exit value is 0 on success and a non-zero value on error (including a lost or reordered message).
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99 -pthread.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "message_slot.h"
+
+#define SPINS 1000 //checks of the other side's index before sleeping
+
+typedef struct m
+{
+	long long seq;
+	long long ts;
+}shm_msg;
+
+typedef struct e
+{
+	int fd;
+	struct msg_slot_shm* shm;
+	size_t len;
+	unsigned long kicks, sleeps;
+	int err;
+}end;
+
+void* produce(void* arg);
+void* consume(void* arg);
+int open_end(end* e);
+void wait_for(end* e, volatile unsigned int* flag, short events, int (*ready)(struct msg_slot_shm*));
+int not_empty(struct msg_slot_shm* shm);
+int not_full(struct msg_slot_shm* shm);
+long long now_ns();
+int cmp_ll(const void* a, const void* b);
+
+static char* path;
+static unsigned int channel;
+static long long messages = 1000000;
+static long long* lat; //latency of each message in ns
+
+int main (int argc, char* argv[]){
+	int fd;
+	struct msg_slot_shm_conf conf = {1024, 64};
+	end prod, cons;
+	pthread_t pt, ct;
+	struct timespec start, stop;
+	double secs;
+	if (argc<3){
+		puts("This function demands at least 2 arguments: <slot file> <channel> [messages] [slots] [slot size]");
+		return -1;
+	}
+	path = argv[1];
+	channel = atoi(argv[2]);
+	if (argc>3 && atoll(argv[3])>0){
+		messages = atoll(argv[3]);
+	}
+	if (argc>4){
+		conf.slots = atoi(argv[4]);
+	}
+	if (argc>5){
+		conf.slot_size = atoi(argv[5]);
+	}
+	if ((lat = malloc(messages*sizeof(long long)))==NULL){
+		puts("Memory allocation error");
+		return -1;
+	}
+	fd = open(path,O_RDWR);
+	if (fd<0){
+		printf("Error opening file. errno: %d\n",errno);
+		return -1;
+	}
+	if (ioctl(fd, MSG_SLOT_CHANNEL, channel)!=0 || (ioctl(fd, MSG_SLOT_SHM, &conf)!=0 && errno!=EEXIST)){
+		close(fd);
+		printf("ioctel error, errno: %d\n",errno);
+		return -1;
+	}
+	close(fd);
+	memset(&prod,0,sizeof(end));
+	memset(&cons,0,sizeof(end));
+	if (open_end(&prod) || open_end(&cons)){
+		return -1;
+	}
+	if (prod.shm->head != prod.shm->tail){
+		puts("The shared ring is not empty, use another channel");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (pthread_create(&ct, NULL, consume, &cons) || pthread_create(&pt, NULL, produce, &prod)){
+		puts("Error creating thread");
+		return -1;
+	}
+	pthread_join(pt, NULL);
+	pthread_join(ct, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	munmap(prod.shm, prod.len);
+	munmap(cons.shm, cons.len);
+	close(prod.fd);
+	close(cons.fd);
+	if (prod.err || cons.err){
+		free(lat);
+		return -1;
+	}
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	qsort(lat, messages, sizeof(long long), cmp_ll);
+	printf("messages,msgs_per_s,median_us,p99_us,max_us,kicks,sleeps\n");
+	printf("%lld,%.0f,%.2f,%.2f,%.2f,%lu,%lu\n",messages,messages/secs,lat[messages/2]/1e3,
+			lat[(long long)(messages*0.99)]/1e3,lat[messages-1]/1e3,prod.kicks+cons.kicks,prod.sleeps+cons.sleeps);
+	free(lat);
+	return 0;
+}
+
+/*
+ * Opens the slot for one side, selects the channel and maps the whole shared ring (its length is read from the first
+ * page). Returns 0 on success, 1 on failure.
+ */
+int open_end(end* e){
+	struct msg_slot_shm* hdr;
+	if ((e->fd = open(path,O_RDWR)) < 0 || ioctl(e->fd, MSG_SLOT_CHANNEL, channel)!=0){
+		printf("Error opening channel, errno: %d\n",errno);
+		return 1;
+	}
+	hdr = mmap(NULL, MSG_SLOT_SHM_DATA, PROT_READ, MAP_SHARED, e->fd, 0);
+	if (hdr==MAP_FAILED){
+		printf("mmap error, errno: %d\n",errno);
+		return 1;
+	}
+	e->len = MSG_SLOT_SHM_DATA + (size_t)hdr->slots * hdr->slot_size;
+	if (hdr->slot_size < sizeof(unsigned int) + sizeof(shm_msg)){
+		printf("Slots of %u bytes are too small for a %zu byte message\n",hdr->slot_size,sizeof(shm_msg));
+		munmap(hdr, MSG_SLOT_SHM_DATA);
+		return 1;
+	}
+	munmap(hdr, MSG_SLOT_SHM_DATA);
+	e->shm = mmap(NULL, e->len, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0);
+	if (e->shm==MAP_FAILED){
+		printf("mmap error, errno: %d\n",errno);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Producer thread: writes messages 0..messages-1, waiting while the ring is full.
+ */
+void* produce(void* arg){
+	end* e = arg;
+	struct msg_slot_shm* shm = e->shm;
+	unsigned int head = shm->head;
+	char* slot;
+	shm_msg m;
+	for (m.seq=0 ; m.seq<messages ; m.seq++){
+		if (head - __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) == shm->slots){
+			wait_for(e, &shm->producer_waiting, POLLOUT, not_full);
+			if (e->err){
+				return NULL;
+			}
+		}
+		slot = (char*)shm + MSG_SLOT_SHM_DATA + (size_t)(head & (shm->slots - 1)) * shm->slot_size;
+		m.ts = now_ns();
+		*(unsigned int*)slot = sizeof(m);
+		memcpy(slot + sizeof(unsigned int), &m, sizeof(m));
+		__atomic_store_n(&shm->head, ++head, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); //head before the flag, pairs with the consumer's fence in wait_for
+		if (shm->consumer_waiting){
+			e->kicks++;
+			ioctl(e->fd, MSG_SLOT_SHM_KICK);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Consumer thread: reads messages until it has all of them, checking their order.
+ */
+void* consume(void* arg){
+	end* e = arg;
+	struct msg_slot_shm* shm = e->shm;
+	unsigned int tail = shm->tail;
+	char* slot;
+	shm_msg m;
+	long long i;
+	for (i=0 ; i<messages ; i++){
+		if (__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) == tail){
+			wait_for(e, &shm->consumer_waiting, POLLIN, not_empty);
+			if (e->err){
+				return NULL;
+			}
+		}
+		slot = (char*)shm + MSG_SLOT_SHM_DATA + (size_t)(tail & (shm->slots - 1)) * shm->slot_size;
+		memcpy(&m, slot + sizeof(unsigned int), sizeof(m));
+		lat[i] = now_ns() - m.ts;
+		if (m.seq != i || *(unsigned int*)slot != sizeof(m)){ //before tail frees the slot
+			printf("Got message %lld when expecting %lld\n",m.seq,i);
+			e->err = 1;
+			return NULL;
+		}
+		__atomic_store_n(&shm->tail, ++tail, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (shm->producer_waiting){
+			e->kicks++;
+			ioctl(e->fd, MSG_SLOT_SHM_KICK);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Waits until ready(shm): spins, then sets the waiting flag, checks again (the other side may have advanced before
+ * it saw the flag) and sleeps in poll until it is kicked.
+ */
+void wait_for(end* e, volatile unsigned int* flag, short events, int (*ready)(struct msg_slot_shm*)){
+	struct pollfd p = {e->fd, events, 0};
+	int i;
+	for (i=0 ; i<SPINS ; i++){
+		if (ready(e->shm)){
+			return;
+		}
+	}
+	while (!ready(e->shm)){
+		*flag = 1;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); //flag before the index check, pairs with the other side's fence
+		if (ready(e->shm)){
+			break;
+		}
+		e->sleeps++;
+		if (poll(&p, 1, -1) < 0 && errno != EINTR){
+			printf("poll error, errno: %d\n",errno);
+			e->err = 1;
+			break;
+		}
+	}
+	*flag = 0;
+}
+
+int not_empty(struct msg_slot_shm* shm){
+	return __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) != shm->tail;
+}
+
+int not_full(struct msg_slot_shm* shm){
+	return shm->head - __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) != shm->slots;
+}
+
+long long now_ns(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int cmp_ll(const void* a, const void* b){
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
@@ -8,19 +8,74 @@
  *  This driver is used to operate multiple channel message slots.
  *  Each slot will be represented by a file on the file system.
  *
- *  Each slot has a minor number, which ranges between 0-255 as 256 is the
- * 	maximum number of devices per driver.
+ *  Each slot has a minor number, in the range of minors the driver registers (the minors module parameter, 256 by
+ * 	default and up to 2^20). The major number is dynamic unless set with the major module parameter.
  *
- * 	Each slot's state is represented by three objects:
- * 	 - list of channels existing in slot.
+ * 	Each slot's state is the index of channels existing in slot (xarray keyed by channel number, so switching
+ * 	channels is O(1)) and their count. It is allocated on the first open of the slot and kept until the module is
+ * 	removed, so unused minors cost nothing.
+ *
+ * 	Each open file of a slot has its own state (in file->private_data), so processes sharing a slot don't
+ * 	change each other's channel or mode:
  *	 - Current active channel.
  *	 - Write mode.
+ *	 - Generation of the last message it read.
  *
  *	Each Channel's is represented by struct and it's state is given by:
  *	 - Channel number.
  *	 - 128 Byte buffer.
  *	 - Number of used bytes in buffer.
- *	 - Pointer to next channel in list (orderd by creation time, not numerical order)
+ *	 - Seqlock protecting the buffer and its length.
+ *	 - Generation, counting the writes to the channel.
+ *	 - Wait queue of readers waiting for a message.
+ *	 - Optional ring of messages (set with the MSG_SLOT_RING ioctl), with its overflow and drop counters.
+ *	 - Optional shared ring (created with the MSG_SLOT_SHM ioctl), mmaped by a producer and a consumer.
+ *
+ *	In ring mode every write adds a message (the write mode is ignored) and every read removes the oldest one, so
+ *	producers can run ahead of consumers by up to the ring depth. A write to a full ring fails with EAGAIN, or drops
+ *	the oldest message with MSG_SLOT_RING_DROP_OLDEST. Changing the ring discards the messages in it.
+ *
+ *	The shared ring bypasses read and write: the producer fills a slot and advances head, the consumer reads it and
+ *	advances tail, both in shared pages (see struct msg_slot_shm). The driver is only entered to sleep and wake up:
+ *	a side that finds the ring empty (or full) sets its waiting flag, checks again and sleeps in poll, and the other
+ *	side calls MSG_SLOT_SHM_KICK after advancing if it sees the flag. poll reports the ring readable when it is not
+ *	empty, and writable unless it is full. A shared ring lives as long as its channel and cannot be resized.
+ *
+ *	Messages stay in the channel after they are read. A blocking read returns a message newer than the last one read
+ *	through that file, sleeping until a writer publishes one, so a read loop gets each message once instead of
+ *	spinning on the same one. poll reports a file readable on the same condition, so consumers can epoll many slot
+ *	files and read each message once. A file opened with O_NONBLOCK reads the current message, seen or not, and fails
+ *	with EWOULDBLOCK only if the channel has none. Writes never wait.
+ *
+ *	Memory:
+ *	 - Channels come from their own slab cache (message_slot_channel).
+ *	 - The max_channels and max_slot_channels module parameters limit the number of channels in all slots and in
+ *	   each slot, creating more fails with ENOSPC (0, the default, for no limit).
+ *	 - MSG_SLOT_DELETE removes a channel (and its messages) that no file uses, and a shrinker removes unused empty
+ *	   channels under memory pressure (also ones unused for reclaim_idle_secs, with their messages, if it is set).
+ *	 - MSG_SLOT_MEM reports the number of channels and the memory they take.
+ *
+ *	Statistics (debugfs, message_slot/<minor>/ for every opened slot):
+ *	 - stats: reads, writes, bytes, channel switches and errors by type of the slot. They are counted per CPU, so
+ *	   the hot paths never share a counter, and summed when the file is read.
+ *	 - channels: one line per channel with its reads, writes, bytes, waiting messages and idle time. Writes are
+ *	   counted under the channel's seqlock; reads of a single-message channel don't take it, so their counts are
+ *	   approximate when many readers run at once.
+ *	 - Error messages of the read, write and ioctl paths are rate limited, so a misbehaving process can't flood the log.
+ *
+ *	Locking:
+ *	 - Channel lookup is lockless: xa_load walks the slot's xarray under RCU, and takes a reference on the channel.
+ *	 - A channel holds one reference for the slot's index, one for every file it is the current channel of, and one
+ *	   for every operation in progress on it (and every mapping of its shared ring). It is removed only when the index
+ *	   reference is the only one left and nobody waits on it in poll; removing it sets the count to 0, so lookups
+ *	   that race with it fail to take a reference, and it is freed after an RCU grace period.
+ *	 - Channel creation inserts with xa_cmpxchg, so two openers creating the same channel agree on one of them.
+ *	 - Writers of a channel serialize on its seqlock. Readers never take it: they copy the message to a stack buffer
+ *	   and retry if a write ran meanwhile, so they never block writers or see a torn message.
+ *	 - Ring readers remove messages, so they take the seqlock like writers. The ring is only touched under it.
+ *	 - Creating and mapping the shared ring serialize on the channel's shm_lock mutex (mapping may sleep).
+ *	 - User memory is only touched outside the lock (copies go through a stack buffer, or a temporary one for messages
+ *	   longer than BUF_LEN).
  */
 
 #undef __KERNEL__
@@ -31,156 +86,1204 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/xarray.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/err.h>
+#include <linux/rcupdate.h>
+#include <linux/jiffies.h>
+#include <linux/shrinker.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "message_slot.h"
 
 MODULE_LICENSE("GPL");
 
-// device major number
-static int major;
+static unsigned int major; //0 for a dynamic major number
+module_param(major, uint, 0444);
+MODULE_PARM_DESC(major, "Major number of the slots, 0 (the default) to have one allocated");
+static unsigned int minors = 256;
+module_param(minors, uint, 0444);
+MODULE_PARM_DESC(minors, "Number of slots (minor numbers 0..minors-1), at most 2^20");
+
+static unsigned int max_channels;
+module_param(max_channels, uint, 0644);
+MODULE_PARM_DESC(max_channels, "Most channels in all slots together, 0 for no limit");
+static unsigned int max_slot_channels;
+module_param(max_slot_channels, uint, 0644);
+MODULE_PARM_DESC(max_slot_channels, "Most channels in one slot, 0 for no limit");
+static unsigned int reclaim_idle_secs;
+module_param(reclaim_idle_secs, uint, 0644);
+MODULE_PARM_DESC(reclaim_idle_secs, "Under memory pressure also remove channels unused for this many seconds, with their messages (0: only empty channels)");
+
+#define DELETE_ANY 0 //how delete_channel chooses: any unused channel
+#define DELETE_EMPTY 1 //only an unused channel with no message
+#define DELETE_IDLE 2 //also an unused channel not read or written for reclaim_idle_secs
+
+#define ERR_WOULDBLOCK 0 //kinds of errors counted in slot_stats
+#define ERR_NOSPC 1
+#define ERR_MSGSIZE 2
+#define ERR_INVAL 3
+#define ERR_FAULT 4
+#define ERR_NOMEM 5
+#define ERR_INTR 6
+#define ERR_OTHER 7
+#define ERR_TYPES 8
+
+static const char* const err_names[ERR_TYPES] = {"wouldblock", "nospc", "msgsize", "inval", "fault", "nomem", "intr",
+		"other"};
+
+typedef struct st
+{
+	u64 reads, writes; //successful ones
+	u64 read_bytes, write_bytes;
+	u64 switches; //MSG_SLOT_CHANNEL calls that changed a file's channel
+	u64 errors[ERR_TYPES];
+}slot_stats;
+
+typedef struct s
+{
+	unsigned int minor;
+	struct xarray channels; //all channels of the slot, indexed by channel number
+	atomic_t count; //number of channels of the slot
+	slot_stats __percpu* stats;
+	struct dentry* dir; //debugfs directory of the slot
+}slot;
 
 typedef struct c
 {
 	unsigned int num;
+	slot* slot; //slot of the channel
+	atomic_t refs; //references: the slot's index, files, operations in progress and mappings. 0 once removed
+	unsigned long used; //jiffies of the last read, write or switch to the channel
+	struct rcu_head rcu; //frees the channel after lookups that may still see it are done
+	seqlock_t lock; //taken by writers, readers check its sequence and retry
 	char buffer[BUF_LEN]; //buffer containing the messages
 	int index; //number of characters in current message (also the index for next messege to be written to in append*/
-	struct c* next;
+	unsigned int gen; //number of writes so far, changes with every new message
+	wait_queue_head_t readers; //readers and pollers waiting for a message
+	char* ring; //NULL when the channel holds one message, else depth lengths then depth messages of msg_size
+	unsigned int depth, msg_size, flags; //ring geometry and MSG_SLOT_RING_* flags
+	unsigned int head, count; //oldest message in the ring and number of messages in it
+	unsigned long long overflows, drops; //writes that found the ring full, messages discarded before being read
+	struct msg_slot_shm* shm; //shared ring (vmalloc_user), NULL if none, never changes once set
+	unsigned int shm_slots; //geometry of the shared ring, the driver's copy (the one in the pages is user writable)
+	size_t shm_len; //bytes of the mapping
+	struct mutex shm_lock; //serializes creating and mapping the shared ring
+	atomic_t shm_maps; //mappings of the shared ring
+	unsigned long reads, writes, read_bytes, write_bytes; //for debugfs, see Statistics at the top
 }channel;
 
-static char writeMode[256]; //keeps track whether each device is in append or overwrite mode (0/1)
-static channel* cur[256]; //pointer to current channel for each slot.
-static channel* slots[256]; //linked list of all channels, by device (slot)
+typedef struct f
+{
+	slot* slot; //slot of the file (never changes)
+	channel* cur; //pointer to current channel of this open file
+	char writeMode; //whether this open file is in append or overwrite mode (0/1)
+	unsigned int seen; //gen of the last message read through this file, 0 for none (poll reports newer ones)
+}slot_file;
+
+static DEFINE_XARRAY(slots); //state of each slot that was opened, indexed by minor number
+static dev_t first_dev; //device number of slot 0
+static struct cdev slot_cdev;
+static struct dentry* debug_dir; //message_slot directory in debugfs
+static atomic_long_t total_channels; //number of channels of all slots
+static atomic_long_t total_bytes; //memory taken by channels, their rings and shared rings
+static atomic_long_t reclaimed; //channels removed by the shrinker
+static struct kmem_cache* channel_cache;
+static unsigned long reclaim_slot; //where the shrinker goes on scanning (not exact when shrinkers run concurrently)
+static unsigned long reclaim_index;
 
 /*See documentation at top*/
 
+/*
+ * Auxiliary function
+ *
+ * Drops a reference on a channel. The last one (the slot's index) is only dropped by delete_channel.
+ */
+static void put_channel(channel* c)
+{
+	smp_mb__before_atomic(); //a poll registration is seen by delete_channel once the reference is gone
+	atomic_dec(&c->refs);
+}
+
+/*
+ * Auxiliary function
+ *
+ * Takes a reference on the current channel of a file, NULL if it has none. The file's own reference may be dropped
+ * meanwhile by a concurrent MSG_SLOT_CHANNEL on the same file, so the channel is only looked at under RCU.
+ */
+static channel* file_channel(slot_file* f)
+{
+	channel* c;
+	rcu_read_lock();
+	do{ //a channel with no reference left was switched away from, and f->cur already shows the new one
+		c = READ_ONCE(f->cur);
+	}while (c!=NULL && !atomic_inc_not_zero(&c->refs));
+	rcu_read_unlock();
+	return c;
+}
+
+static void touch_channel(channel* c)
+{
+	if (READ_ONCE(c->used) != jiffies){ //don't dirty the cache line more than once per tick
+		WRITE_ONCE(c->used, jiffies);
+	}
+}
+
+/*
+ * Auxiliary function
+ *
+ * Counts a failed operation of a slot by the kind of its error (a negative errno).
+ */
+static void count_error(slot* s, long err)
+{
+	int type;
+	switch (err){
+	case -EWOULDBLOCK:
+		type = ERR_WOULDBLOCK;
+		break;
+	case -ENOSPC:
+		type = ERR_NOSPC;
+		break;
+	case -EMSGSIZE:
+		type = ERR_MSGSIZE;
+		break;
+	case -EINVAL:
+		type = ERR_INVAL;
+		break;
+	case -EFAULT:
+		type = ERR_FAULT;
+		break;
+	case -ENOMEM:
+		type = ERR_NOMEM;
+		break;
+	case -ERESTARTSYS:
+		type = ERR_INTR;
+		break;
+	default:
+		type = ERR_OTHER;
+	}
+	this_cpu_inc(s->stats->errors[type]);
+}
+
+/*
+ * Auxiliary function
+ *
+ * Memory taken by a channel, its ring and its shared ring.
+ */
+static long channel_bytes(channel* c)
+{
+	return sizeof(channel) + (c->ring ? c->depth*(sizeof(unsigned int) + (size_t)c->msg_size) : 0) + c->shm_len;
+}
+
+static void free_channel_rcu(struct rcu_head* head)
+{
+	channel* c = container_of(head, channel, rcu);
+	kvfree(c->ring);
+	vfree(c->shm);
+	kmem_cache_free(channel_cache, c);
+}
+
+/*
+ * Auxiliary function
+ *
+ * Removes a channel from its slot, and frees it after an RCU grace period, if nothing else uses it: no file has it as
+ * its channel or is in an operation on it, its shared ring isn't mapped and nobody waits on it in poll.
+ * how is DELETE_ANY, DELETE_EMPTY or DELETE_IDLE. The messages of a removed channel are lost.
+ * Returns SUCCESS, or -EBUSY if the channel is in use (or, with DELETE_EMPTY/DELETE_IDLE, not empty or idle).
+ * Doesn't sleep, so it can be called under rcu_read_lock.
+ */
+static int delete_channel(channel* c, int how)
+{
+	int empty;
+	if (atomic_cmpxchg(&c->refs, 1, 0) != 1){ //only the index holds it, from now on nobody can take a reference
+		return -EBUSY;
+	}
+	empty = c->index == 0 && c->count == 0 && c->shm == NULL;
+	if (waitqueue_active(&c->readers) || (how == DELETE_EMPTY && !empty) || (how == DELETE_IDLE && !empty &&
+			time_before(jiffies, READ_ONCE(c->used) + reclaim_idle_secs*HZ))){
+		atomic_set(&c->refs, 1);
+		return -EBUSY;
+	}
+	xa_cmpxchg(&c->slot->channels, c->num, c, NULL, GFP_ATOMIC);
+	atomic_dec(&c->slot->count);
+	atomic_long_dec(&total_channels);
+	atomic_long_sub(channel_bytes(c), &total_bytes);
+	call_rcu(&c->rcu, free_channel_rcu);
+	return SUCCESS;
+}
+
+
+//==================== STATISTICS ===============================
+
+// message_slot/<minor>/stats: the per CPU counters of the slot, summed
+static int stats_show(struct seq_file* m, void* v)
+{
+	slot* s = m->private;
+	slot_stats sum, *p;
+	int cpu, i;
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu){
+		p = per_cpu_ptr(s->stats, cpu);
+		sum.reads += READ_ONCE(p->reads);
+		sum.writes += READ_ONCE(p->writes);
+		sum.read_bytes += READ_ONCE(p->read_bytes);
+		sum.write_bytes += READ_ONCE(p->write_bytes);
+		sum.switches += READ_ONCE(p->switches);
+		for (i=0 ; i<ERR_TYPES ; i++){
+			sum.errors[i] += READ_ONCE(p->errors[i]);
+		}
+	}
+	seq_printf(m, "channels %d\nreads %llu\nwrites %llu\nread_bytes %llu\nwrite_bytes %llu\nswitches %llu\n",
+			atomic_read(&s->count), sum.reads, sum.writes, sum.read_bytes, sum.write_bytes, sum.switches);
+	for (i=0 ; i<ERR_TYPES ; i++){
+		seq_printf(m, "errors_%s %llu\n", err_names[i], sum.errors[i]);
+	}
+	return SUCCESS;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+// message_slot/<minor>/channels: a header, then one line per channel in channel order. The position is the channel
+// number (0, which is never a channel, is the header), so a read that stops midway resumes at the right channel.
+// The walk is under RCU: a channel removed meanwhile is still safe to look at, and is only missing from later reads.
+static void* channels_start(struct seq_file* m, loff_t* pos)
+{
+	slot* s = m->private;
+	unsigned long index = *pos;
+	channel* c;
+	rcu_read_lock();
+	if (*pos == 0){
+		return SEQ_START_TOKEN;
+	}
+	c = xa_find(&s->channels, &index, UINT_MAX, XA_PRESENT);
+	if (c!=NULL){
+		*pos = index;
+	}
+	return c;
+}
+
+static void* channels_next(struct seq_file* m, void* v, loff_t* pos)
+{
+	slot* s = m->private;
+	unsigned long index = *pos + 1;
+	channel* c;
+	++*pos; //past the end if nothing is found
+	c = (*pos > UINT_MAX) ? NULL : xa_find(&s->channels, &index, UINT_MAX, XA_PRESENT);
+	if (c!=NULL){
+		*pos = index;
+	}
+	return c;
+}
+
+static void channels_stop(struct seq_file* m, void* v)
+{
+	rcu_read_unlock();
+}
+
+static int channels_show(struct seq_file* m, void* v)
+{
+	channel* c = v;
+	if (v == SEQ_START_TOKEN){
+		seq_puts(m, "channel reads writes read_bytes write_bytes messages idle_ms\n");
+		return SUCCESS;
+	}
+	seq_printf(m, "%u %lu %lu %lu %lu %u %u\n", c->num, READ_ONCE(c->reads), READ_ONCE(c->writes),
+			READ_ONCE(c->read_bytes), READ_ONCE(c->write_bytes),
+			READ_ONCE(c->ring) ? READ_ONCE(c->count) : (READ_ONCE(c->index) != 0),
+			jiffies_to_msecs(jiffies - READ_ONCE(c->used)));
+	return SUCCESS;
+}
+
+static const struct seq_operations channels_seq_ops =
+{
+  .start = channels_start,
+  .next  = channels_next,
+  .stop  = channels_stop,
+  .show  = channels_show,
+};
+
+static int channels_open(struct inode* inode, struct file* file)
+{
+	int ret = seq_open(file, &channels_seq_ops);
+	if (ret == SUCCESS){
+		((struct seq_file*)file->private_data)->private = inode->i_private;
+	}
+	return ret;
+}
+
+static const struct file_operations channels_fops =
+{
+  .owner   = THIS_MODULE,
+  .open    = channels_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = seq_release,
+};
+
+/*
+ * Auxiliary function
+ *
+ * Creates the debugfs directory of a slot. Statistics are optional, so failures (or a kernel without debugfs) are
+ * ignored.
+ */
+static void slot_debugfs(slot* s)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "%u", s->minor);
+	s->dir = debugfs_create_dir(name, debug_dir);
+	debugfs_create_file("stats", 0444, s->dir, s, &stats_fops);
+	debugfs_create_file("channels", 0444, s->dir, s, &channels_fops);
+}
+
+/*
+ * Auxiliary function
+ *
+ * Finds the state of a slot, allocating it on the slot's first open. Slots are only freed when the module is removed.
+ * Returns an ERR_PTR if allocating it failed.
+ */
+static slot* get_slot(unsigned int minor)
+{
+	slot* s, *old;
+	s = xa_load(&slots, minor);
+	if (s!=NULL){
+		return s;
+	}
+	s = kmalloc(sizeof(slot), GFP_KERNEL);
+	if (s==NULL){
+		printk_ratelimited(KERN_ALERT "OPEN : Memory allocation error\n");
+		return ERR_PTR(-ENOMEM);
+	}
+	s->minor = minor;
+	xa_init(&s->channels);
+	atomic_set(&s->count, 0);
+	s->stats = alloc_percpu(slot_stats);
+	if (s->stats==NULL){
+		kfree(s);
+		printk_ratelimited(KERN_ALERT "OPEN : Memory allocation error\n");
+		return ERR_PTR(-ENOMEM);
+	}
+	old = xa_cmpxchg(&slots, minor, NULL, s, GFP_KERNEL);
+	if (old==NULL){
+		slot_debugfs(s);
+		return s;
+	}
+	free_percpu(s->stats);
+	kfree(s); //another open of this slot allocated it meanwhile, or the insertion failed
+	if (xa_is_err(old)){
+		printk_ratelimited(KERN_ALERT "OPEN : Slot index insertion error %d\n",xa_err(old));
+		return ERR_PTR(xa_err(old));
+	}
+	return old;
+}
 
 //================== DEVICE FUNCTIONS ===========================
 static int device_open( struct inode* inode, struct file*  file)
 {
+	slot_file* f;
+	slot* s = get_slot(iminor(inode));
+	if (IS_ERR(s)){
+		return PTR_ERR(s);
+	}
+	f = kzalloc(sizeof(slot_file), GFP_KERNEL); //no channel, overwrite mode
+	if (f==NULL){
+		printk_ratelimited(KERN_ALERT "OPEN : Memory allocation error\n");
+		return -ENOMEM;
+	}
+	f->slot = s;
+	file->private_data = f;
 	return SUCCESS;
 }
 
 //---------------------------------------------------------------
 static int device_release(struct inode* inode, struct file*  file)
 {
+  slot_file* f = file->private_data;
+  if (f->cur!=NULL){
+    put_channel(f->cur);
+  }
+  kfree(f);
   return SUCCESS;
 }
 
+/*
+ * Auxiliary function
+ *
+ * Removes the oldest message of a channel's ring into buf (of size bytes). Called with the channel's seqlock held.
+ * Returns the message length, 0 if the ring is empty, -ENOSPC if the message is longer than length (it is kept),
+ * -ENOBUFS with *need set if it fits length but not buf, and -EAGAIN if the channel is not in ring mode anymore.
+ */
+static int ring_pop(channel* cnl, char* buf, size_t size, size_t length, int* need)
+{
+	unsigned int* lens;
+	int len;
+	if (cnl->ring==NULL){
+		return -EAGAIN;
+	}
+	if (cnl->count==0){
+		return 0;
+	}
+	lens = (unsigned int*)cnl->ring;
+	len = lens[cnl->head];
+	if (len > length){
+		return -ENOSPC;
+	}
+	if (len > size){
+		*need = len;
+		return -ENOBUFS;
+	}
+	memcpy(buf, cnl->ring + cnl->depth*sizeof(unsigned int) + (size_t)cnl->head*cnl->msg_size, len);
+	cnl->head = (cnl->head + 1) % cnl->depth;
+	WRITE_ONCE(cnl->count, cnl->count - 1);
+	return len;
+}
+
+/*
+ * Auxiliary function
+ *
+ * Adds a message to the end of a channel's ring. Called with the channel's seqlock held.
+ * Returns SUCCESS, -EMSGSIZE if the message is longer than the ring's msg_size, or -EAGAIN if the ring is full
+ * (unless it drops the oldest message).
+ */
+static int ring_push(channel* cnl, const char* msg, size_t length)
+{
+	unsigned int* lens = (unsigned int*)cnl->ring;
+	unsigned int tail;
+	if (length > cnl->msg_size){
+		return -EMSGSIZE;
+	}
+	if (cnl->count == cnl->depth){
+		cnl->overflows++;
+		if (!(cnl->flags & MSG_SLOT_RING_DROP_OLDEST)){
+			return -EAGAIN;
+		}
+		cnl->drops++;
+		cnl->head = (cnl->head + 1) % cnl->depth;
+		cnl->count--;
+	}
+	tail = (cnl->head + cnl->count) % cnl->depth;
+	lens[tail] = length;
+	memcpy(cnl->ring + cnl->depth*sizeof(unsigned int) + (size_t)tail*cnl->msg_size, msg, length);
+	WRITE_ONCE(cnl->count, cnl->count + 1);
+	cnl->gen = (cnl->gen + 1) ? cnl->gen + 1 : 1;
+	return SUCCESS;
+}
+
+/*
+ * Auxiliary function
+ *
+ * Reads the message of a channel (the oldest one in ring mode) into a user buffer, waiting for one unless nonblock.
+ * If seen isn't NULL it is set to the generation of the message read (not in ring mode, where reading removes it), and
+ * a blocking read waits for a message of another generation.
+ * Returns the message length or a negative errno.
+ */
+static ssize_t channel_read(channel* cnl, char __user* buffer, size_t length, int nonblock, unsigned int* seen)
+{
+	char msg[BUF_LEN];
+	char* buf = msg; //replaced by a temporary buffer for ring messages longer than BUF_LEN
+	size_t size = BUF_LEN;
+	int len, ring, need = 0;
+	unsigned int seq, gen = 0;
+	while (1){
+		ring = READ_ONCE(cnl->ring)!=NULL;
+		if (ring){ //ring mode, take the oldest message
+			write_seqlock(&cnl->lock);
+			len = ring_pop(cnl, buf, size, length, &need);
+			write_sequnlock(&cnl->lock);
+			if (len == -EAGAIN){ //the ring was removed meanwhile
+				continue;
+			}
+			if (len == -ENOBUFS){
+				if (buf != msg){
+					kfree(buf);
+				}
+				size = need;
+				if ((buf = kmalloc(size, GFP_KERNEL))==NULL){
+					return -ENOMEM;
+				}
+				continue;
+			}
+		}
+		else{
+			do{ //snapshot the message, again if a writer changed it meanwhile
+				seq = read_seqbegin(&cnl->lock);
+				len = READ_ONCE(cnl->index);
+				gen = cnl->gen;
+				memcpy(msg, cnl->buffer, len);
+			}while (read_seqretry(&cnl->lock, seq));
+			if (len != 0 && !nonblock && seen!=NULL && gen == READ_ONCE(*seen)){ //this file already read it, wait for a newer one
+				len = 0;
+			}
+			else if (len > length){ //user buffer not large enough for entire message
+				len = -ENOSPC;
+			}
+		}
+		if (len != 0){
+			break;
+		}
+		if (nonblock){ //no message exists, and the caller doesn't want to wait
+			printk_ratelimited(KERN_ALERT "Tried read from channel where no message exists\n");
+			len = -EWOULDBLOCK;
+			break;
+		}
+		if (wait_event_interruptible(cnl->readers, READ_ONCE(cnl->count) != 0 || (READ_ONCE(cnl->index) != 0 &&
+				(seen==NULL || READ_ONCE(cnl->gen) != READ_ONCE(*seen))))){ //same condition as poll's EPOLLIN
+			len = -ERESTARTSYS; //interrupted while sleeping until a writer publishes
+			break;
+		}
+	}
+	if (len == -ENOSPC){
+		printk_ratelimited(KERN_ALERT "Buffer too short for read, got len %lu\n",length);
+	}
+	else if (len > 0 && copy_to_user(buffer, buf, len)!=0){ //one bulk copy of the whole message
+		printk_ratelimited(KERN_ALERT "Read: write in user space failed\n");
+		len = -EFAULT;
+	}
+	else if (len > 0 && !ring && seen!=NULL){ //poll won't report this message again
+		WRITE_ONCE(*seen, gen);
+	}
+	if (len > 0){
+		this_cpu_inc(cnl->slot->stats->reads);
+		this_cpu_add(cnl->slot->stats->read_bytes, len);
+		WRITE_ONCE(cnl->reads, cnl->reads + 1); //racy, but readers don't share a lock to count under
+		WRITE_ONCE(cnl->read_bytes, cnl->read_bytes + len);
+	}
+	else{
+		count_error(cnl->slot, len);
+	}
+	if (buf != msg){
+		kfree(buf);
+	}
+	return len;
+}
+
+/*
+ * Auxiliary function
+ *
+ * Writes a message from a user buffer to a channel (in ring mode, adds it to the ring), with write mode mode.
+ * Returns the message length or a negative errno.
+ */
+static ssize_t channel_write(channel* cnl, const char __user* buffer, size_t length, char mode)
+{
+	char msg[BUF_LEN];
+	char* buf = msg; //replaced by a temporary buffer for ring messages longer than BUF_LEN
+	int start, ret;
+	if (length==0 || length > (READ_ONCE(cnl->ring) ? READ_ONCE(cnl->msg_size) : BUF_LEN)){ //messege to write is 0 or too long
+		printk_ratelimited(KERN_ALERT "messege to write is 0 or too long, got len %lu\n",length);
+		count_error(cnl->slot, -EMSGSIZE);
+		return -EMSGSIZE;
+	}
+	if (length > BUF_LEN && (buf = kmalloc(length, GFP_KERNEL))==NULL){
+		count_error(cnl->slot, -ENOMEM);
+		return -ENOMEM;
+	}
+	if (copy_from_user(buf, buffer, length)!=0){ //copy whole message first, a fault leaves the channel untouched
+		printk_ratelimited(KERN_ALERT "Write: read from user space failed\n");
+		ret = -EFAULT;
+		goto out;
+	}
+	write_seqlock(&cnl->lock);
+	if (cnl->ring!=NULL){
+		ret = ring_push(cnl, buf, length);
+	}
+	else{
+		start = (cnl->index)*mode; //if append (writemode==1) we just write from end, if overwrite (writemode==0) our write will start from 0 index
+		ret = -EMSGSIZE; //no room left to append (or the ring was removed meanwhile and the message is too long)
+		if ((start+length) <= BUF_LEN){
+			memcpy(cnl->buffer + start, buf, length);
+			WRITE_ONCE(cnl->index, start + length);
+			cnl->gen = (cnl->gen + 1) ? cnl->gen + 1 : 1; //0 is kept for "nothing read"
+			ret = SUCCESS;
+		}
+	}
+	if (ret == SUCCESS){
+		cnl->writes++;
+		cnl->write_bytes += length;
+	}
+	write_sequnlock(&cnl->lock);
+	if (ret == SUCCESS){
+		wake_up_interruptible_poll(&cnl->readers, EPOLLIN | EPOLLRDNORM);
+		this_cpu_inc(cnl->slot->stats->writes);
+		this_cpu_add(cnl->slot->stats->write_bytes, length);
+		ret = length;
+	}
+	else if (ret == -EMSGSIZE){
+		printk_ratelimited(KERN_ALERT "messege to write is too long, got len %lu\n",length);
+	}
+out:
+	if (ret < 0){
+		count_error(cnl->slot, ret);
+	}
+	if (buf != msg){
+		kfree(buf);
+	}
+	return ret;
+}
+
 //---------------------------------------------------------------
 // a process which has already opened
 // the device file attempts to read from it
 static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset)
 {
-	int i;
-	char* cnl_buf;
-	unsigned int minor = iminor(file_inode(file));
-	if (cur[minor]==NULL){ //no channel selected for this slot yet
-		printk(KERN_ALERT "Tried read with no channel defined for slot\n");
+	ssize_t ret;
+	slot_file* f = file->private_data;
+	channel* cnl = file_channel(f);
+	if (cnl==NULL){ //no channel selected for this file yet
+		printk_ratelimited(KERN_ALERT "Tried read with no channel defined for slot\n");
+		count_error(f->slot, -EINVAL);
 		return -EINVAL;
 	}
-	if ((cur[minor])->index == 0){ //no message exists
-		printk(KERN_ALERT "Tried read from channel where no message exists\n");
-		return -EWOULDBLOCK;
+	ret = channel_read(cnl, buffer, length, file->f_flags & O_NONBLOCK, &f->seen);
+	put_channel(cnl);
+	return ret;
+}
+
+
+static ssize_t device_write( struct file* file, const char __user* buffer, size_t length, loff_t* offset)
+{
+	ssize_t ret;
+	slot_file* f = file->private_data;
+	channel* cnl = file_channel(f);
+	if (cnl==NULL){ //no channel selected for this file yet
+		printk_ratelimited(KERN_ALERT "Tried write with no channel defined for slot\n");
+		count_error(f->slot, -EINVAL);
+		return -EINVAL;
 	}
-	if (((int)(cur[minor])->index) > length){ //user buffer not large enough for entire message
-		printk(KERN_ALERT "Buffer too short for read, got len %lu but message length is %d\n",length,(int)(cur[minor])->index);
-		return -ENOSPC;
+	ret = channel_write(cnl, buffer, length, READ_ONCE(f->writeMode));
+	put_channel(cnl);
+	return ret;
+}
+
+//---------------------------------------------------------------
+// a process waits (poll/select/epoll) for a new message on the current channel of the file
+static __poll_t device_poll(struct file* file, poll_table* wait)
+{
+	slot_file* f = file->private_data;
+	channel* cnl = file_channel(f);
+	struct msg_slot_shm* shm;
+	unsigned int head, tail;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM; //writes never wait (but a full shared ring does)
+	if (cnl==NULL){ //no channel yet, nothing to wait for
+		return mask;
 	}
-	cnl_buf = (cur[minor])->buffer;
-	for (i=0; i<(cur[minor])->index ; i++){
-		if (put_user(cnl_buf[i],buffer+i)!=0){
-			printk(KERN_ALERT "Read: write in user space failed\n");
-			return -EFAULT;
+	poll_wait(file, &cnl->readers, wait);
+	if (READ_ONCE(cnl->count) != 0 || (READ_ONCE(cnl->index) != 0 && READ_ONCE(cnl->gen) != READ_ONCE(f->seen))){
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if ((shm = smp_load_acquire(&cnl->shm)) != NULL){ //indices are user written, only compared
+		head = READ_ONCE(shm->head);
+		tail = READ_ONCE(shm->tail);
+		if (head != tail){
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+		if (head - tail >= cnl->shm_slots){
+			mask &= ~(EPOLLOUT | EPOLLWRNORM);
 		}
 	}
-	return i;
+	put_channel(cnl); //the poll registration stays, and keeps the channel from being removed
+	return mask;
 }
 
+//---------------------------------------------------------------
+// mappings of a channel's shared ring are counted in shm_maps (forks and splits of a mapping included), and each
+// holds a reference on the channel
+static void shm_vm_open(struct vm_area_struct* vma)
+{
+	channel* c = vma->vm_private_data;
+	atomic_inc(&c->refs);
+	atomic_inc(&c->shm_maps);
+}
 
-static ssize_t device_write( struct file* file, const char __user* buffer, size_t length, loff_t* offset)
+static void shm_vm_close(struct vm_area_struct* vma)
+{
+	channel* c = vma->vm_private_data;
+	atomic_dec(&c->shm_maps);
+	put_channel(c);
+}
+
+static const struct vm_operations_struct shm_vm_ops =
 {
-	char* cnl_buf;
-	int start, i;
-	unsigned int minor = iminor(file_inode(file));
-	if (cur[minor]==NULL){ //no channel selected for this slot yet
-		printk(KERN_ALERT "Tried write with no channel defined for slot\n");;
+  .open  = shm_vm_open,
+  .close = shm_vm_close,
+};
+
+//---------------------------------------------------------------
+// a process maps the shared ring of the current channel of the file (from offset 0, up to its whole length)
+static int device_mmap(struct file* file, struct vm_area_struct* vma)
+{
+	channel* cnl = file_channel(file->private_data);
+	int ret = -EINVAL;
+	if (cnl==NULL){ //no channel selected for this file yet
+		printk_ratelimited(KERN_ALERT "Tried mmap with no channel defined for slot\n");
 		return -EINVAL;
 	}
-	start = ((cur[minor])->index)*((char)writeMode[minor]); //if append (writemode==1) we just write from end, if overwrite (writemode==0) our write will start from 0 index
-	if ((start+length) > BUF_LEN || length==0){ //messege to write is 0 or too long
-		printk(KERN_ALERT "messege to write is 0 or too long, got len %lu while remaining buffer is %d long\n",length,(128 - start));
-		return -EMSGSIZE;
+	mutex_lock(&cnl->shm_lock);
+	if (cnl->shm!=NULL && vma->vm_pgoff==0 && vma->vm_end - vma->vm_start <= cnl->shm_len){
+		ret = remap_vmalloc_range(vma, cnl->shm, 0);
 	}
-	cnl_buf = ((cur[minor])->buffer)+start;
-	for (i=0 ; i<length; i++){
-		if (get_user(cnl_buf[i], buffer+i)!=0){
-			printk(KERN_ALERT "Write: read from user space failed\n");
-			return -EFAULT;
+	if (ret==SUCCESS){ //the mapping keeps our reference
+		vma->vm_private_data = cnl;
+		vma->vm_ops = &shm_vm_ops;
+		atomic_inc(&cnl->shm_maps);
+	}
+	mutex_unlock(&cnl->shm_lock);
+	if (ret!=SUCCESS){
+		put_channel(cnl);
+	}
+	return ret;
+}
+
+/*
+ * Auxiliary function
+ *
+ * Creates the shared ring of a channel, zeroed (empty, nobody waiting) with its geometry in the first page.
+ */
+static int set_shm(channel* cnl, const struct msg_slot_shm_conf* conf)
+{
+	struct msg_slot_shm* shm;
+	size_t len;
+	if (conf->slots == 0 || (conf->slots & (conf->slots - 1)) || conf->slot_size < 16 || conf->slot_size > 4096 ||
+			conf->slot_size % 8 || (unsigned long)conf->slots * conf->slot_size > MSG_SLOT_SHM_MAX){
+		return -EINVAL;
+	}
+	len = PAGE_ALIGN(MSG_SLOT_SHM_DATA + (size_t)conf->slots * conf->slot_size);
+	mutex_lock(&cnl->shm_lock);
+	if (cnl->shm!=NULL){
+		mutex_unlock(&cnl->shm_lock);
+		return -EEXIST;
+	}
+	if ((shm = vmalloc_user(len))==NULL){
+		mutex_unlock(&cnl->shm_lock);
+		printk_ratelimited(KERN_ALERT "SET SHM : Memory allocation error\n");
+		return -ENOMEM;
+	}
+	shm->slots = conf->slots;
+	shm->slot_size = conf->slot_size;
+	cnl->shm_slots = conf->slots;
+	cnl->shm_len = len;
+	atomic_long_add(len, &total_bytes);
+	smp_store_release(&cnl->shm, shm); //poll may look at it without the mutex
+	mutex_unlock(&cnl->shm_lock);
+	return SUCCESS;
+}
+
+/*
+ * Auxiliary function
+ *
+ * Sets (or with depth 0 removes) the ring of a channel. The messages in the channel are discarded (and counted as
+ * drops if they were in a ring). The new ring is allocated before taking the channel's lock, the old one freed after.
+ */
+static int set_ring(channel* cnl, const struct msg_slot_ring* conf)
+{
+	char* ring = NULL, *old;
+	long bytes = 0;
+	if (conf->depth != 0){
+		if (conf->msg_size == 0 || conf->msg_size > MSG_SLOT_MAX_MSG ||
+				(unsigned long)conf->depth * conf->msg_size > MSG_SLOT_MAX_RING){
+			return -EINVAL;
+		}
+		bytes = conf->depth*(sizeof(unsigned int) + (size_t)conf->msg_size);
+		ring = kvmalloc(bytes, GFP_KERNEL);
+		if (ring==NULL){
+			printk_ratelimited(KERN_ALERT "SET RING : Memory allocation error\n");
+			return -ENOMEM;
+		}
+	}
+	write_seqlock(&cnl->lock);
+	old = cnl->ring;
+	if (old!=NULL){
+		bytes -= cnl->depth*(sizeof(unsigned int) + (size_t)cnl->msg_size);
+	}
+	cnl->drops += cnl->count;
+	cnl->ring = ring;
+	cnl->depth = conf->depth;
+	cnl->msg_size = conf->depth ? conf->msg_size : 0;
+	cnl->flags = conf->flags;
+	cnl->head = 0;
+	WRITE_ONCE(cnl->count, 0);
+	WRITE_ONCE(cnl->index, 0);
+	write_sequnlock(&cnl->lock);
+	atomic_long_add(bytes, &total_bytes);
+	kvfree(old);
+	return SUCCESS;
+}
+
+/*
+ * Auxiliary function
+ *
+ * Finds channel cnl of a slot (one xarray lookup, whatever the number of channels) and takes a reference on it.
+ * If it doesn't exist, creates it if create is set (within the channel limits), else returns NULL.
+ * Returns an ERR_PTR if creating it failed.
+ */
+static channel* get_channel(slot* s, unsigned int cnl, int create)
+{
+	channel* tmp, *old;
+	long total;
+	unsigned int in_slot;
+	while (1){
+		rcu_read_lock();
+		tmp = xa_load(&s->channels, cnl); //lockless (RCU) lookup
+		if (tmp!=NULL && atomic_inc_not_zero(&tmp->refs)){
+			rcu_read_unlock();
+			touch_channel(tmp);
+			return tmp;
+		}
+		rcu_read_unlock();
+		if (tmp!=NULL){ //being removed, it will leave the index in a moment
+			cpu_relax();
+			continue;
+		}
+		if (!create){
+			return NULL;
+		}
+		total = atomic_long_inc_return(&total_channels); //counted first, so concurrent creations can't pass the limits
+		in_slot = atomic_inc_return(&s->count);
+		if ((max_channels && total > max_channels) || (max_slot_channels && in_slot > max_slot_channels)){
+			atomic_long_dec(&total_channels);
+			atomic_dec(&s->count);
+			printk_ratelimited(KERN_ALERT "SET CAHNNEL : Too many channels to create channel %u\n",cnl);
+			return ERR_PTR(-ENOSPC);
+		}
+		tmp = kmem_cache_zalloc(channel_cache, GFP_KERNEL); //no channel with this num found. we will create a new one.
+		if (tmp==NULL){
+			atomic_long_dec(&total_channels);
+			atomic_dec(&s->count);
+			printk_ratelimited(KERN_ALERT "SET CAHNNEL : Memory allocation error\n");
+			return ERR_PTR(-ENOMEM);
 		}
+		tmp->num = cnl;
+		tmp->slot = s;
+		atomic_set(&tmp->refs, 2); //the index's and the caller's
+		tmp->used = jiffies;
+		seqlock_init(&tmp->lock);
+		init_waitqueue_head(&tmp->readers);
+		mutex_init(&tmp->shm_lock);
+		atomic_set(&tmp->shm_maps, 0);
+		old = xa_cmpxchg(&s->channels, cnl, NULL, tmp, GFP_KERNEL); //put this new channel in the index of current slot
+		if (old==NULL){
+			atomic_long_add(sizeof(channel), &total_bytes);
+			return tmp;
+		}
+		kmem_cache_free(channel_cache, tmp);
+		atomic_long_dec(&total_channels);
+		atomic_dec(&s->count);
+		if (xa_is_err(old)){
+			printk_ratelimited(KERN_ALERT "SET CAHNNEL : Index insertion error %d\n",xa_err(old));
+			return ERR_PTR(xa_err(old));
+		}
+		//another file created this channel meanwhile, use that one
 	}
-	(cur[minor])->index = start + i;
-	return i;
 }
 
 /*
  * Auxiliary function
  *
- * Sets the working channel of a slot to the one defined by user.
- * If exists such a slot, this function finds it.
- * Else, creates a new slot with this number.
+ * Sets the working channel of an open file of a slot to the one defined by user.
+ * If exists such a channel, this function finds it.
+ * Else, creates a new channel with this number.
  */
-int set_channel(unsigned int minor, unsigned int cnl){
-	channel* prev = NULL, *tmp = slots[minor];
-	if (cur[minor]!=NULL && (cur[minor])->num == cnl){ //this is already set as this slot's working channel
+int set_channel(slot_file* f, unsigned int cnl){
+	channel* tmp, *old;
+	rcu_read_lock(); //the current channel may be switched and removed meanwhile by another thread
+	tmp = READ_ONCE(f->cur);
+	if (tmp!=NULL && tmp->num == cnl){ //this is already set as this file's working channel
+		rcu_read_unlock();
 		return SUCCESS;
 	}
-	while (tmp!=NULL){
-		if (tmp->num == cnl){
-			cur[minor] = tmp; //this channel already exists, we will just switch this slot to it
-			return SUCCESS;
-		}
-		prev = tmp;
-		tmp = tmp->next;
+	rcu_read_unlock();
+	tmp = get_channel(f->slot, cnl, 1);
+	if (IS_ERR(tmp)){
+		count_error(f->slot, PTR_ERR(tmp));
+		return PTR_ERR(tmp);
+	}
+	this_cpu_inc(f->slot->stats->switches);
+	WRITE_ONCE(f->seen, 0); //nothing read from this channel through this file yet
+	old = xchg(&f->cur, tmp); // update this channel is the current working channel
+	if (old!=NULL){
+		put_channel(old);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Auxiliary function
+ *
+ * MSG_SLOT_BATCH_WRITE and MSG_SLOT_BATCH_READ: writes (reads) a message to (from) the channel of every entry, setting
+ * each entry's result like write (read) would return. Reads never wait and don't create channels (a missing channel
+ * has no message). The file's own channel and write mode are left alone.
+ * Returns the number of entries that succeeded, or a negative errno if the batch itself is invalid.
+ */
+static long batch_ioctl(slot* s, unsigned int cmd, void __user* arg)
+{
+	struct msg_slot_batch batch;
+	struct msg_slot_batch_entry* e;
+	channel* cnl;
+	unsigned int i;
+	long ok = 0;
+	if (copy_from_user(&batch, arg, sizeof(batch))!=0){
+		return -EFAULT;
+	}
+	if (batch.count == 0 || batch.count > MSG_SLOT_MAX_BATCH){
+		return -EINVAL;
 	}
-	tmp = kmalloc(sizeof(channel), GFP_KERNEL); //no channel with this num found. we will create a new one.
-	if (tmp==NULL){
-		printk(KERN_ALERT "SET CAHNNEL : Memory allocation error\n");
+	e = kvmalloc_array(batch.count, sizeof(*e), GFP_KERNEL);
+	if (e==NULL){
 		return -ENOMEM;
 	}
-	memset(tmp,0,sizeof(channel)); //initialize channel
-	tmp->num = cnl;
-	if (prev==NULL){  //put this new channel in channel list for current slot
-		slots[minor] = tmp; //the list was originaly empty. this is the head of the list to update in "slots" data structure
+	if (copy_from_user(e, u64_to_user_ptr(batch.entries), batch.count*sizeof(*e))!=0){
+		kvfree(e);
+		return -EFAULT;
 	}
-	else{
-		prev->next = tmp; //append new channel to end of exisiting channel list
+	for (i=0 ; i<batch.count ; i++){
+		if (e[i].channel == 0 || (cmd == MSG_SLOT_BATCH_WRITE && e[i].mode >= 3)){
+			e[i].result = -EINVAL;
+			count_error(s, e[i].result);
+			continue;
+		}
+		cnl = get_channel(s, e[i].channel, cmd == MSG_SLOT_BATCH_WRITE);
+		if (IS_ERR(cnl)){
+			e[i].result = PTR_ERR(cnl);
+			count_error(s, e[i].result);
+		}
+		else if (cnl == NULL){ //reads don't create channels, a missing one has no message
+			e[i].result = -EWOULDBLOCK;
+			count_error(s, e[i].result);
+		}
+		else if (cmd == MSG_SLOT_BATCH_WRITE){
+			e[i].result = channel_write(cnl, u64_to_user_ptr(e[i].buf), e[i].length, e[i].mode);
+		}
+		else{
+			e[i].result = channel_read(cnl, u64_to_user_ptr(e[i].buf), e[i].length, 1, NULL);
+		}
+		if (!IS_ERR_OR_NULL(cnl)){
+			put_channel(cnl);
+		}
+		if (e[i].result >= 0){
+			ok++;
+		}
 	}
-	cur[minor] = tmp; // update this new channel is the current working channel
-	return SUCCESS;
+	if (copy_to_user(u64_to_user_ptr(batch.entries), e, batch.count*sizeof(*e))!=0){
+		ok = -EFAULT;
+	}
+	kvfree(e);
+	return ok;
+}
+
+/*
+ * Auxiliary function
+ *
+ * MSG_SLOT_RING and MSG_SLOT_RING_STATS, on the current channel of a file.
+ */
+static long ring_ioctl(channel* cnl, unsigned int cmd, void __user* arg)
+{
+	struct msg_slot_ring conf;
+	struct msg_slot_ring_stats stats;
+	int ret;
+	if (cnl==NULL){ //no channel selected for this file yet
+		printk_ratelimited(KERN_ALERT "Tried ring ioctl with no channel defined for slot\n");
+		return -EINVAL;
+	}
+	if (cmd == MSG_SLOT_RING){
+		if (copy_from_user(&conf, arg, sizeof(conf))!=0){
+			return -EFAULT;
+		}
+		if ((ret = set_ring(cnl, &conf))!=SUCCESS){
+			printk_ratelimited(KERN_ALERT "ioctel: couldent set ring of depth %u and message size %u\n",conf.depth,conf.msg_size);
+		}
+		return ret;
+	}
+	write_seqlock(&cnl->lock);
+	stats.depth = cnl->depth;
+	stats.msg_size = cnl->msg_size;
+	stats.flags = cnl->flags;
+	stats.count = cnl->count;
+	stats.overflows = cnl->overflows;
+	stats.drops = cnl->drops;
+	write_sequnlock(&cnl->lock);
+	return copy_to_user(arg, &stats, sizeof(stats)) ? -EFAULT : SUCCESS;
+}
+
+/*
+ * Auxiliary function
+ *
+ * MSG_SLOT_SHM and MSG_SLOT_SHM_KICK, on the current channel of a file.
+ */
+static long shm_ioctl(channel* cnl, unsigned int cmd, void __user* arg)
+{
+	struct msg_slot_shm_conf conf;
+	int ret;
+	if (cnl==NULL){ //no channel selected for this file yet
+		printk_ratelimited(KERN_ALERT "Tried shared ring ioctl with no channel defined for slot\n");
+		return -EINVAL;
+	}
+	if (cmd == MSG_SLOT_SHM_KICK){ //the other side of the shared ring is (about to be) asleep in poll
+		wake_up_interruptible_poll(&cnl->readers, EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM);
+		return SUCCESS;
+	}
+	if (copy_from_user(&conf, arg, sizeof(conf))!=0){
+		return -EFAULT;
+	}
+	if ((ret = set_shm(cnl, &conf))!=SUCCESS && ret != -EEXIST){
+		printk_ratelimited(KERN_ALERT "ioctel: couldent set shared ring of %u slots of %u bytes\n",conf.slots,conf.slot_size);
+	}
+	return ret;
 }
 
 //----------------------------------------------------------------
 static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param)
 {
-	unsigned int minor;
-	minor = iminor(file_inode(file));
+	slot* s = ((slot_file*)file->private_data)->slot;
+	channel* cnl;
+	struct msg_slot_mem mem;
+	long ret;
 	if (ioctl_command_id == MSG_SLOT_CHANNEL && ioctl_param!=0){
-		if (!set_channel(minor,ioctl_param))
-			return SUCCESS;
-		printk( KERN_ALERT "ioctel: couldent set new channel %lu\n",ioctl_param);
+		ret = set_channel(file->private_data,ioctl_param); //counts its own errors
+		if (ret != SUCCESS){
+			printk_ratelimited( KERN_ALERT "ioctel: couldent set new channel %lu\n",ioctl_param);
+		}
+		return ret; //-ENOSPC past the channel limits, -ENOMEM
 	}
 	if (ioctl_command_id == MSG_SLOT_WRITE_MODE && ioctl_param<3){
-		writeMode[minor] = (char) ioctl_param;
+		WRITE_ONCE(((slot_file*)file->private_data)->writeMode, (char) ioctl_param);
 		return SUCCESS;
 	}
-	printk( KERN_ALERT "Ioctel failed got %u for command and %lu for param\n",ioctl_command_id,ioctl_param);
-	printk( KERN_ALERT "Expected %lu for Channel and %lu for write mode\n",MSG_SLOT_CHANNEL,MSG_SLOT_WRITE_MODE);
+	if (ioctl_command_id == MSG_SLOT_RING || ioctl_command_id == MSG_SLOT_RING_STATS ||
+			ioctl_command_id == MSG_SLOT_SHM || ioctl_command_id == MSG_SLOT_SHM_KICK){
+		cnl = file_channel(file->private_data);
+		if (ioctl_command_id == MSG_SLOT_RING || ioctl_command_id == MSG_SLOT_RING_STATS){
+			ret = ring_ioctl(cnl, ioctl_command_id, (void __user*)ioctl_param);
+		}
+		else{
+			ret = shm_ioctl(cnl, ioctl_command_id, (void __user*)ioctl_param);
+		}
+		if (cnl!=NULL){
+			put_channel(cnl);
+		}
+		return ret;
+	}
+	if (ioctl_command_id == MSG_SLOT_BATCH_WRITE || ioctl_command_id == MSG_SLOT_BATCH_READ){
+		return batch_ioctl(s, ioctl_command_id, (void __user*)ioctl_param);
+	}
+	if (ioctl_command_id == MSG_SLOT_DELETE && ioctl_param!=0){
+		rcu_read_lock();
+		cnl = xa_load(&s->channels, ioctl_param);
+		ret = cnl ? delete_channel(cnl, DELETE_ANY) : -ENOENT;
+		rcu_read_unlock();
+		return ret;
+	}
+	if (ioctl_command_id == MSG_SLOT_MEM){
+		mem.channels = atomic_long_read(&total_channels);
+		mem.slot_channels = atomic_read(&s->count);
+		mem.bytes = atomic_long_read(&total_bytes);
+		mem.reclaimed = atomic_long_read(&reclaimed);
+		mem.max_channels = READ_ONCE(max_channels);
+		mem.max_slot_channels = READ_ONCE(max_slot_channels);
+		return copy_to_user((void __user*)ioctl_param, &mem, sizeof(mem)) ? -EFAULT : SUCCESS;
+	}
+	printk_ratelimited( KERN_ALERT "Ioctel failed got %u for command and %lu for param\n",ioctl_command_id,ioctl_param);
+	printk_ratelimited( KERN_ALERT "Expected %lu for Channel and %lu for write mode\n",MSG_SLOT_CHANNEL,MSG_SLOT_WRITE_MODE);
+	count_error(s, -EINVAL);
 	return -EINVAL;
 }
 
+//==================== RECLAIM ==================================
+
+// the shrinker asks how many channels there are, and then removes up to nr_to_scan of them that are unused and empty
+// (or idle, see reclaim_idle_secs), going on from where the last scan stopped
+static unsigned long shrink_count(struct shrinker* shr, struct shrink_control* sc)
+{
+	long n = atomic_long_read(&total_channels);
+	return n > 0 ? n : SHRINK_EMPTY;
+}
+
+static unsigned long shrink_scan(struct shrinker* shr, struct shrink_control* sc)
+{
+	unsigned long freed = 0, scanned = 0, index = READ_ONCE(reclaim_index), minor = READ_ONCE(reclaim_slot);
+	int how = READ_ONCE(reclaim_idle_secs) ? DELETE_IDLE : DELETE_EMPTY, wraps = 0;
+	slot* s;
+	channel* c;
+	rcu_read_lock();
+	while (scanned < sc->nr_to_scan && wraps < 2){ //the second wrap means every slot was looked at
+		s = xa_find(&slots, &minor, ULONG_MAX, XA_PRESENT);
+		if (s==NULL){ //past the last opened slot, start over from the first one
+			minor = 0;
+			index = 0;
+			wraps++;
+			continue;
+		}
+		c = xa_find(&s->channels, &index, ULONG_MAX, XA_PRESENT);
+		if (c==NULL){ //no more channels in this slot, go on with the next one
+			minor++;
+			index = 0;
+			continue;
+		}
+		if (delete_channel(c, how)==SUCCESS){
+			freed++;
+		}
+		scanned++;
+		index++;
+	}
+	rcu_read_unlock();
+	WRITE_ONCE(reclaim_slot, minor);
+	WRITE_ONCE(reclaim_index, index);
+	atomic_long_add(freed, &reclaimed);
+	return freed ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker* shrinker;
+
+static int register_reclaim(void)
+{
+	shrinker = shrinker_alloc(0, "message_slot");
+	if (shrinker==NULL){
+		return -ENOMEM;
+	}
+	shrinker->count_objects = shrink_count;
+	shrinker->scan_objects = shrink_scan;
+	shrinker_register(shrinker);
+	return SUCCESS;
+}
+
+static void unregister_reclaim(void)
+{
+	shrinker_free(shrinker);
+}
+#else
+static struct shrinker shrinker =
+{
+  .count_objects = shrink_count,
+  .scan_objects  = shrink_scan,
+  .seeks         = DEFAULT_SEEKS,
+};
+
+static int register_reclaim(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	return register_shrinker(&shrinker, "message_slot");
+#else
+	return register_shrinker(&shrinker);
+#endif
+}
+
+static void unregister_reclaim(void)
+{
+	unregister_shrinker(&shrinker);
+}
+#endif
+
 //==================== DEVICE SETUP =============================
 
 // This structure will hold the functions to be called
@@ -191,6 +1294,8 @@ struct file_operations Fops =
   .write          = device_write,
   .open           = device_open,
   .unlocked_ioctl = device_ioctl,
+  .poll           = device_poll,
+  .mmap           = device_mmap,
   .release        = device_release,
 };
 
@@ -198,41 +1303,83 @@ struct file_operations Fops =
 // Initialize the module - Register the character device
 static int __init simple_init(void)
 {
-  // init data-structures
-  memset(writeMode, 0, 256);
-  memset(cur, 0, 256*sizeof(channel*));
-  memset(slots, 0, 256*sizeof(channel*));
+  int err;
+  if (minors == 0 || minors > MINORMASK + 1){
+    printk( KERN_ALERT "message_slot: minors must be between 1 and %u\n", MINORMASK + 1);
+    return -EINVAL;
+  }
+  channel_cache = kmem_cache_create("message_slot_channel", sizeof(channel), 0, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT, NULL);
+  if (channel_cache==NULL){
+    printk( KERN_ALERT "message_slot: channel cache creation failed\n");
+    return -ENOMEM;
+  }
+  if ((err = register_reclaim())!=SUCCESS){
+    kmem_cache_destroy(channel_cache);
+    printk( KERN_ALERT "message_slot: shrinker registraion failed\n");
+    return err;
+  }
 
-  // Register driver capabilities. Obtain major num
-  major = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &Fops);
+  debug_dir = debugfs_create_dir("message_slot", NULL); //statistics, see the top
+
+  // Register the range of device numbers: the requested major, or obtain one
+  if (major)
+  {
+    first_dev = MKDEV(major, 0);
+    err = register_chrdev_region(first_dev, minors, DEVICE_RANGE_NAME);
+  }
+  else
+  {
+    err = alloc_chrdev_region(&first_dev, 0, minors, DEVICE_RANGE_NAME);
+  }
+  if (err == SUCCESS)
+  {
+    cdev_init(&slot_cdev, &Fops);
+    slot_cdev.owner = THIS_MODULE;
+    err = cdev_add(&slot_cdev, first_dev, minors); //the slots can be opened from here on
+    if (err != SUCCESS)
+    {
+      unregister_chrdev_region(first_dev, minors);
+    }
+  }
 
   // Negative values signify an error
-  if( major < 0 )
+  if( err < 0 )
   {
+    debugfs_remove_recursive(debug_dir);
+    unregister_reclaim();
+    kmem_cache_destroy(channel_cache);
     printk( KERN_ALERT "message_slot: registraion failed\n");
-    return major;
+    return err;
   }
-  printk(KERN_INFO "message_slot: registered major number %d\n", MAJOR_NUM);
+  printk(KERN_INFO "message_slot: registered major number %u, minors 0-%u\n", MAJOR(first_dev), minors - 1);
   return SUCCESS;
 }
 
 //---------------------------------------------------------------
 static void __exit simple_cleanup(void)
 {
-	int i;
-	channel* tmp, *c;
-	//free all allocated channels
-	for (i=0 ; i<256 ; i++){
-		if ((c = slots[i]) !=NULL){
-			while (c!=NULL){
-					tmp = c;
-					c = c->next;
-					kfree(tmp);
-			}
+	unsigned long minor, cnl;
+	slot* s;
+	channel* c;
+	cdev_del(&slot_cdev);// Unregister the device
+	unregister_chrdev_region(first_dev, minors);
+	debugfs_remove_recursive(debug_dir); //waits for readers of the statistics of the slots freed below
+	unregister_reclaim();
+	//free all slots and allocated channels (no file is open, so only the index holds them)
+	xa_for_each(&slots, minor, s){
+		xa_for_each(&s->channels, cnl, c){
+			kvfree(c->ring);
+			vfree(c->shm);
+			kmem_cache_free(channel_cache, c);
 		}
+		xa_destroy(&s->channels);
+		free_percpu(s->stats);
+		kfree(s);
 	}
-	unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);// Unregister the device
-	printk(KERN_INFO "message_slot: unregistered major number %d\n", MAJOR_NUM);
+	xa_destroy(&slots);
+	rcu_barrier(); //channels removed earlier are freed by RCU callbacks
+	kmem_cache_destroy(channel_cache);
+	printk(KERN_INFO "message_slot: unregistered major number %u\n", MAJOR(first_dev));
 }
 
 //---------------------------------------------------------------
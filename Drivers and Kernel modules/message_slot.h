@@ -9,7 +9,7 @@
 #define MESSAGE_SLOT_H_
 
 
-#define MAJOR_NUM 243
+#define MAJOR_NUM 243 //the ioctl magic number, the device major number is dynamic (see the major module parameter)
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 1, unsigned long)
 #define MSG_SLOT_WRITE_MODE _IOW(MAJOR_NUM, 0, unsigned long)
 #define BUF_LEN 128
@@ -17,5 +17,84 @@
 #define FAILURE -1
 #define DEVICE_RANGE_NAME "message_slot_driver"
 
+// ring mode: a channel keeps up to depth messages of up to msg_size bytes, read in FIFO order (each read removes one)
+#define MSG_SLOT_MAX_MSG 4096 //largest msg_size
+#define MSG_SLOT_MAX_RING (1 << 20) //largest depth * msg_size of one channel
+#define MSG_SLOT_RING_DROP_OLDEST 1 //flag: a write to a full ring drops the oldest message (default: fails with EAGAIN)
+
+struct msg_slot_ring{
+	unsigned int depth; //number of messages the ring holds, 0 to go back to one message
+	unsigned int msg_size; //largest message, 1..MSG_SLOT_MAX_MSG
+	unsigned int flags;
+};
+
+struct msg_slot_ring_stats{
+	unsigned int depth; //0 when the channel is not in ring mode
+	unsigned int msg_size;
+	unsigned int flags;
+	unsigned int count; //messages waiting in the ring
+	unsigned long long overflows; //writes that found the ring full
+	unsigned long long drops; //messages discarded before they were read
+};
+
+#define MSG_SLOT_RING _IOW(MAJOR_NUM, 2, struct msg_slot_ring) //set the ring of the file's current channel
+#define MSG_SLOT_RING_STATS _IOR(MAJOR_NUM, 3, struct msg_slot_ring_stats)
+
+// shared ring: a single producer / single consumer ring of a channel, mmaped by both and advanced without syscalls
+#define MSG_SLOT_SHM_DATA 4096 //offset of the first slot in the mapping, after the struct msg_slot_shm page
+#define MSG_SLOT_SHM_MAX (4 << 20) //largest slots * slot_size
+
+struct msg_slot_shm_conf{
+	unsigned int slots; //number of slots, a power of 2
+	unsigned int slot_size; //bytes per slot, a multiple of 8 from 16 to 4096: a 4 byte length, then the message
+};
+
+struct msg_slot_shm{ //first page of the mapping, head and tail are free running (slot of index i is i & (slots - 1))
+	unsigned int slots; //geometry, set by the driver
+	unsigned int slot_size;
+	unsigned int pad0[14];
+	volatile unsigned int head; //slots written, only advanced by the producer (after writing the slot)
+	volatile unsigned int consumer_waiting; //set by the consumer before it sleeps in poll, then the producer kicks
+	unsigned int pad1[14];
+	volatile unsigned int tail; //slots read, only advanced by the consumer (after reading the slot)
+	volatile unsigned int producer_waiting; //set by the producer before it sleeps in poll on a full ring
+	unsigned int pad2[14];
+};
+
+#define MSG_SLOT_SHM _IOW(MAJOR_NUM, 4, struct msg_slot_shm_conf) //create the shared ring of the current channel
+#define MSG_SLOT_SHM_KICK _IO(MAJOR_NUM, 5) //wake the pollers of the current channel
+
+// batches: one ioctl writes (reads) a message to (from) each of up to MSG_SLOT_MAX_BATCH channels
+#define MSG_SLOT_MAX_BATCH 256
+
+struct msg_slot_batch_entry{
+	unsigned int channel; //channel id, non zero
+	unsigned int mode; //write mode for this message (0 overwrite, 1 append), unused by reads
+	unsigned long long buf; //user pointer to the message (write) or to the buffer to read it to (read)
+	unsigned int length; //message length (write) or buffer size (read)
+	int result; //set by the driver: bytes written (read), or a negative errno as write (read) would set
+};
+
+struct msg_slot_batch{
+	unsigned long long entries; //user pointer to count entries, their results are written back
+	unsigned int count; //1..MSG_SLOT_MAX_BATCH
+	unsigned int pad;
+};
+
+#define MSG_SLOT_BATCH_WRITE _IOW(MAJOR_NUM, 6, struct msg_slot_batch) //returns the number of entries written
+#define MSG_SLOT_BATCH_READ _IOW(MAJOR_NUM, 7, struct msg_slot_batch) //returns the number of entries read, never waits
+
+struct msg_slot_mem{
+	unsigned long long channels; //channels in all slots
+	unsigned long long slot_channels; //channels in this slot
+	unsigned long long bytes; //memory taken by all channels, their rings and shared rings
+	unsigned long long reclaimed; //channels removed by the shrinker under memory pressure
+	unsigned long long max_channels; //limits (module parameters), 0 for none
+	unsigned long long max_slot_channels;
+};
+
+#define MSG_SLOT_DELETE _IOW(MAJOR_NUM, 8, unsigned long) //remove a channel no file uses (EBUSY if one does)
+#define MSG_SLOT_MEM _IOR(MAJOR_NUM, 9, struct msg_slot_mem)
+
 
 #endif /* MESSAGE_SLOT_H_ */
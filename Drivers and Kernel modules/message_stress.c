@@ -0,0 +1,176 @@
+/*
+ * message_stress.c
+ *
+ * Multi-threaded stress test of a message slot: checks that concurrent readers never see a torn message, and measures
+ * how reads and writes scale with the number of threads.
+ *
+ * Command line arguments:
+ * 1. argv[1] – message slot file path.
+ * 2. argv[2] – optional, the maximal number of writer (and reader) threads (default 8).
+ * 3. argv[3] – optional, seconds to run each step (default 1).
+ * 4. argv[4] – optional, "shared" to have all threads use channel 1, instead of one channel per writer/reader pair.
+ * The flow:
+ * For 1, 2, 4, ... up to the maximal number of threads T: start T writer and T reader threads, each with its own
+ * open file of the slot. Writers overwrite their channel with messages whose every byte is the same letter and whose
+ * length is derived from that letter, so a message mixing two writes is detected. Readers read (with O_NONBLOCK, so
+ * they get the current message without waiting for a new one) and check messages until the step ends.
+ * Prints one CSV line per step: threads,channels,writes_per_s,reads_per_s,empty_reads,torn
+ * Exit value is 0 if no torn message was seen, and a non-zero value on error or torn messages.
+ * Should compile without warnings or errors using gcc –O3 –Wall –std=gnu99 -pthread.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "message_slot.h"
+
+#define MSG_LEN(letter) (16 + ((letter) - 'a') * 4) //16..116 bytes, all of them the letter
+
+typedef struct w
+{
+	pthread_t thread;
+	int fd;
+	int writer; //1 for writer, 0 for reader
+	unsigned long ops; //messages written or read
+	unsigned long empty; //reads that found no message yet
+	unsigned long torn; //reads of an inconsistent message
+	int err; //errno of a failed call, 0 if none
+}worker;
+
+void* write_loop(void* arg);
+void* read_loop(void* arg);
+
+static volatile int stop; //set by main at the end of a step
+
+int main (int argc, char* argv[]){
+	int max = 8, seconds = 1, shared = 0, t, i, channels, failed = 0;
+	unsigned long writes, reads, empty, torn, total_torn = 0;
+	worker* w;
+	if (argc<2){
+		puts("This function demands at least 1 argument: <slot file> [max threads] [seconds] [shared]");
+		return -1;
+	}
+	if (argc>2 && atoi(argv[2])>0){
+		max = atoi(argv[2]);
+	}
+	if (argc>3 && atoi(argv[3])>0){
+		seconds = atoi(argv[3]);
+	}
+	if (argc>4 && !strcmp(argv[4], "shared")){
+		shared = 1;
+	}
+	w = calloc(2*max, sizeof(worker));
+	if (w==NULL){
+		puts("Memory allocation error");
+		return -1;
+	}
+	printf("threads,channels,writes_per_s,reads_per_s,empty_reads,torn\n");
+	for (t=1 ; ; t = (t*2 > max) ? max : t*2){ //doubling, the last step is max
+		channels = shared ? 1 : t;
+		stop = 0;
+		for (i=0 ; i<2*t ; i++){ //workers 0..t-1 write, t..2t-1 read, pair i and i+t share a channel
+			memset(&w[i], 0, sizeof(worker));
+			w[i].writer = i < t;
+			if ((w[i].fd = open(argv[1],w[i].writer ? O_RDWR : O_RDWR | O_NONBLOCK)) < 0){
+				printf("Error opening file. errno: %d\n",errno);
+				return -1;
+			}
+			if (ioctl(w[i].fd, MSG_SLOT_WRITE_MODE, 0)!=0 || ioctl(w[i].fd, MSG_SLOT_CHANNEL, shared ? 1 : (i % t) + 1)!=0){
+				printf("ioctel error, errno: %d\n",errno);
+				return -1;
+			}
+		}
+		for (i=0 ; i<2*t ; i++){
+			if (pthread_create(&w[i].thread, NULL, w[i].writer ? write_loop : read_loop, &w[i])){
+				puts("Error creating thread");
+				return -1;
+			}
+		}
+		sleep(seconds);
+		stop = 1;
+		writes = reads = empty = torn = 0;
+		for (i=0 ; i<2*t ; i++){
+			pthread_join(w[i].thread, NULL);
+			close(w[i].fd);
+			if (w[i].err){
+				printf("%s error, errno: %d\n",w[i].writer ? "Write" : "Read",w[i].err);
+				failed = 1;
+			}
+			if (w[i].writer){
+				writes += w[i].ops;
+			}
+			else{
+				reads += w[i].ops;
+			}
+			empty += w[i].empty;
+			torn += w[i].torn;
+		}
+		total_torn += torn;
+		printf("%d,%d,%.0f,%.0f,%lu,%lu\n",t,channels,(double)writes/seconds,(double)reads/seconds,empty,torn);
+		if (failed || t==max){
+			break;
+		}
+	}
+	free(w);
+	if (total_torn){
+		printf("Saw %lu torn messages\n",total_torn);
+	}
+	return (failed || total_torn) ? 1 : 0;
+}
+
+/*
+ * Writer thread: overwrites its channel with messages of letters a..z in turn until the step ends.
+ */
+void* write_loop(void* arg){
+	worker* w = arg;
+	char buf[BUF_LEN];
+	char letter = 'a';
+	while (!stop){
+		memset(buf, letter, MSG_LEN(letter));
+		if (write(w->fd, buf, MSG_LEN(letter)) != MSG_LEN(letter)){
+			w->err = errno;
+			return NULL;
+		}
+		w->ops++;
+		letter = (letter == 'z') ? 'a' : letter + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Reader thread: reads its channel until the step ends, counting messages that are not made of one letter or whose
+ * length doesn't match their letter.
+ */
+void* read_loop(void* arg){
+	worker* w = arg;
+	char buf[BUF_LEN];
+	int len, i;
+	while (!stop){
+		if ((len = read(w->fd, buf, BUF_LEN)) < 0){
+			if (errno == EWOULDBLOCK){ //the writer didn't write yet
+				w->empty++;
+				continue;
+			}
+			w->err = errno;
+			return NULL;
+		}
+		w->ops++;
+		if (buf[0] < 'a' || buf[0] > 'z' || len != MSG_LEN(buf[0])){
+			w->torn++;
+			continue;
+		}
+		for (i=1 ; i<len ; i++){
+			if (buf[i] != buf[0]){
+				w->torn++;
+				break;
+			}
+		}
+	}
+	return NULL;
+}
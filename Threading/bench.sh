@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Benchmarks distributed_subdir_size on synthetic trees made by make_tree.
+# Usage: bench.sh [max_threads] [work_dir]
+# 		max_threads - Runs the scanner with 1..max_threads threads (default: number of online CPUs).
+# 		work_dir - Absolute directory to build the programs and trees in (default /tmp/dss_bench).
+#
+# For every tree shape (wide, deep, mix), cache state, order and thread count one CSV line is printed to stdout:
+# 		shape,cache,order,threads,seconds,dirs_per_s,files_per_s,lock_wait_ms,efficiency
+# order is readdir (default) or inode (-o). efficiency is the speedup over one thread (same shape, cache and order)
+# divided by the number of threads.
+#
+# warm runs follow a run that already read the tree. cold runs drop the page, dentry and inode caches first,
+# which needs a writable /proc/sys/vm/drop_caches (root); without it cold runs are skipped.
+# Set REPS to repeat each run and keep the fastest (default 3).
+#
+
+set -e
+cd "$(dirname "$0")"
+MAX=${1:-$(getconf _NPROCESSORS_ONLN)}
+WORK=${2:-/tmp/dss_bench}
+REPS=${REPS:-3}
+CC=${CC:-gcc}
+
+mkdir -p "$WORK"
+$CC -O3 -Wall -std=gnu99 -pthread -o "$WORK/dss" distributed_subdir_size.c subdir_scan.c
+$CC -O3 -Wall -o "$WORK/make_tree" make_tree.c
+
+CACHES=warm
+if [ -w /proc/sys/vm/drop_caches ]; then
+	CACHES="warm cold"
+else
+	echo "drop_caches is not writable, skipping cold cache runs" >&2
+fi
+
+echo "shape,cache,order,threads,seconds,dirs_per_s,files_per_s,lock_wait_ms,efficiency"
+for shape in wide deep mix; do
+	if [ ! -d "$WORK/$shape" ]; then
+		"$WORK/make_tree" "$WORK/$shape" $shape >&2
+	fi
+	"$WORK/dss" "$WORK/$shape" 1 -q >/dev/null #warm up caches and metadata
+	for cache in $CACHES; do
+		for order in readdir inode; do
+			flag=""
+			if [ $order = inode ]; then
+				flag=-o
+			fi
+			base=""
+			t=1
+			while [ $t -le "$MAX" ]; do
+				best=""
+				r=0
+				while [ $r -lt "$REPS" ]; do
+					if [ $cache = cold ]; then
+						sync
+						echo 3 > /proc/sys/vm/drop_caches
+					fi
+					# stats line: Stats: D dirs, F files, B bytes in S s (X dirs/s, Y files/s), empty wait E ms, queue lock wait W ms
+					line=$("$WORK/dss" "$WORK/$shape" $t -q -s $flag 2>&1 >/dev/null | grep '^Stats:')
+					secs=$(echo "$line" | awk '{print $9}')
+					if [ -z "$best" ] || awk "BEGIN {exit !($secs < $best)}"; then
+						best=$secs
+						dps=$(echo "$line" | awk '{print substr($11, 2)}')
+						fps=$(echo "$line" | awk '{print $13}')
+						wait=$(echo "$line" | awk '{print $(NF-1)}')
+					fi
+					r=$((r + 1))
+				done
+				if [ -z "$base" ]; then
+					base=$best
+				fi
+				eff=$(awk "BEGIN {printf \"%.3f\", ($best > 0 ? $base / $best / $t : 0)}")
+				echo "$shape,$cache,$order,$t,$best,$dps,$fps,$wait,$eff"
+				t=$((t + 1))
+			done
+		done
+	done
+done
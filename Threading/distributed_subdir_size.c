@@ -7,27 +7,97 @@
  * C code to exercise using threading.
  * This program receives two command line arguments:
  * 		Dir - Name of a directory - used as a root for traversing directories.
- * 		N - Number of threads.
+ * 		N - Number of threads, or "auto" (same as -A with 4 threads per online CPU).
+ * And optional flags:
+ * 		-k K - Number of largest directories to report (default 1).
+ * 		-r   - Also report inclusive (recursive) sizes of every subtree, and the largest subtree.
+ * 		-i F - Use F as a persistent scan index: reuse sizes of unchanged directories and rewrite it after the scan.
+ * 		-d S - Daemon (watch) mode: after the scan keep sizes current and answer queries on unix socket S.
+ * 		-f F - Output format of per directory records: text (default), csv, json (one object per line) or bin.
+ * 		-q   - Quiet, print only the summary.
+ * 		-u   - Disk usage: sum allocated bytes (st_blocks), count hard linked files once, stay on root's filesystem.
+ * 		-X   - With -u, do cross into other filesystems mounted under root.
+ * 		-w W - Coordinator mode: split the tree between W worker processes, each scanning with N threads.
+ * 		-s   - Print scan statistics (directories, files, bytes, rates and time spent waiting for the queue lock).
+ * 		-p S - Print a progress line to stderr every S seconds, and a final report when the scan is done.
+ * 		-e P - Exclude sub directories matching glob P (repeatable). P with a '/' is matched against the full path.
+ * 		-I P - Include sub directories matching glob P even if they match an exclude pattern (repeatable).
+ * 		-m D - Max depth: don't scan directories more than D levels below Dir (Dir itself is level 0).
+ * 		-x   - One filesystem: don't scan directories on other filesystems mounted under Dir.
+ * 		-a   - Also report file count and bytes by file extension and by log2 size bucket, over the whole tree.
+ * 		-A   - Auto: tune the number of threads scanning between 1 and N while scanning, and report how it changed.
+ * 		-R F - Resumable: if the scan is interrupted, save the directories still queued to state file F. If F exists, the
+ * 		       scan continues from it (only its directories are scanned) and F is removed once the scan completes.
+ * 		-o   - Inode order: stat each directory's entries and take queued directories by inode number (cold caches, HDDs).
  *
  * For each directory in Dir's subtree, the programs sums the file sizes that lay *directly* inside a directory
  * (meaning: files contained in a sub-directory are not counted in their forefathers size).
  *
- * Search starts from directory "dir", and work is distributed by N threads.
+ * The traversal itself (threads and their queue, subtree sizes, the scan index, disk usage, pruning, aggregation and
+ * statistics) is done by the subdir_scan library, see subdir_scan.c. This program is its command line: it passes the
+ * options on, receives every directory through the library's callback, and does the output, watch mode, coordinator
+ * mode and progress reporting around it. Build with:
+ * 		gcc -O3 -pthread -o distributed_subdir_size distributed_subdir_size.c subdir_scan.c
  *
- * Search is organized using a linked queue: each thread dequeues a directory name and starts to sum it's files's sizes.
- * As multiple threads are working simultaneously, concurrency issues are dealt with using conditional variables and
- * mutex locks (only one thread can edit queue at each point).
+ * The K largest directories are tracked without any shared lock: the callback runs in the scanning thread and gets its
+ * index, and each thread keeps its own bounded min-heap of size K (root holds the smallest of the K kept so far, so a
+ * directory that can't make it is dropped with one comparison, before its name is copied).
+ * Heaps are merged by main after all threads were joined. The largest subtree (-r) is kept per thread the same way.
  *
- * To avoid resource waste, if queue is empty threads waiting to dequeue wait on conditional variable "empty" until
- * a new item is queued.
+ * Watch mode (-d) keeps running after the threaded scan. Every directory's size goes to a hash table keyed by path,
+ * and the tree is watched for changes: by one fanotify mark on the whole filesystem where permitted, otherwise by an
+ * inotify watch per directory. The backend is opened before the scan and each inotify watch is added as its directory
+ * is scanned, so events of the scan's time wait in the kernel's queue and are read once the table is seeded (a
+ * directory that changed before its inotify watch existed is rescanned then too). Events only mark directories as dirty (or queue new directories to be added), and
+ * dirty directories are rescanned at their own level once events have been quiet for a short while (or a longer while
+ * has passed since the first of them), so a burst of writes costs one rescan.
+ * Queries are answered on a unix stream socket, one line per connection:
+ * 		SIZE <path> - files total size of directory path.
+ * 		TOP         - the K largest directories, one "<size> <path>" per line.
+ * The daemon runs in main's thread alone after the scan threads were joined, so its structures need no locking.
  *
- * The program uses two counters for number of live threads and number of idle threads.
- * When a thread encounters an empty queue and all other threads are idle, this means the work is done.
- * The last remaining threads falgs search is over and wakes all waiting threads.
+ * Per directory records are not printed with printf (all threads would serialize on the stdio lock for every line).
+ * Each thread formats its records into a private 64KB buffer, which is written to stdout in one write, under a lock,
+ * only when it fills up. Main writes what is left in all buffers after join (threads stop only between directories,
+ * so a buffer is never left half written).
+ * In csv, json and bin formats the summary goes to stderr, so stdout holds records only.
+ * A bin record is a 16 byte header: size (uint64), path length (uint32) and type (uint32: 0 directory, 1 subtree,
+ * 2 removed) in host byte order, followed by the path (not null terminated).
  *
+ * Disk usage mode (-u) also keeps the scan on root's filesystem, unless -X.
+ *
+ * Coordinator mode (-w) runs the scan in W worker processes instead of one. The coordinator reads root's level itself
+ * and keeps its sub directories as a pool of jobs. Workers are forked and connected by unix socket pairs. An idle
+ * worker is handed the next job, scans that subtree with the usual threaded scan, streams its records back in bin
+ * format and reports it is done. When the pool runs dry while some workers are idle, the coordinator asks a busy
+ * worker to give away half of its queue (those directories are shallowest, so they tend to be the largest subtrees)
+ * and they go back to the pool. So one huge subtree ends up spread over all workers.
+ * The coordinator merges records into its own output in the selected format and keeps the K largest.
+ * Messages are frames: a header (uint32 length, uint32 type) followed by length bytes.
+ * 		coordinator to worker: JOB <path>, STEAL, QUIT
+ * 		worker to coordinator: RECS <bin records>, JOB <path> (given away), STOLEN (end of give away), DONE
+ * -r, -i, -d and -u keep state inside one process, so they are not available with -w.
+ * A worker that dies loses the directories still queued in it, which are not rescanned: the coordinator names the job
+ * it was on (directories under it may be missing from the output and from the K largest) and exits with 1.
+ *
+ * A reporter thread runs alongside the scan and prints progress (dirs, files, bytes, queue depth, idle threads, time
+ * waited on q_mutex and on "empty", and dirs/s of each thread since the previous line) every -p seconds, and at any
+ * time on SIGUSR1. It reads the scanning threads' counters, queue length and idle count without locks, so a line is a
+ * close estimate, not a snapshot.
+ *
+ * Signals are not handled asynchronously: SIGINT and SIGUSR1 are blocked in every thread and read from a signalfd,
+ * by the reporter while scanning and by the poll loops of the coordinator and of watch mode. So SIGINT is handled in
+ * a normal thread, which may take locks: it stops the scan cooperatively (see subdir_scan.c), every thread finishes
+ * the directory it is on and the records so far are flushed, with the summary of what was scanned. With -R the
+ * directories still queued are saved, and a later run with the same -R continues from them. Its records and summary
+ * cover only the directories scanned in that run; -R is not available with -r, -i, -d or -w, whose state is not saved.
+ *
+ * Pruned directories are counted and reported after the scan. An index hit skips statting files, so -a can't be
+ * used with -i.
  *
  */
 
+#define _GNU_SOURCE //open_by_handle_at for fanotify
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,475 +105,1875 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <errno.h>
 #include <signal.h>
 #include <libgen.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <limits.h>
+#include "subdir_scan.h"
 
-#define EMPTY ((q.head)==NULL) //macro to check state of queue
-#define ALL_IDLE (idle >= (total-1)) //macro to check if all threads are idle
-#define LAST (idle == (total-1)) //macro to check if all threads but this one are idle
+#define COALESCE_MS 200 //rescan dirty directories after events were quiet for this long
+#define COALESCE_MAX_MS 2000 //or after this long since the first pending event, even if events keep coming
+#define PENDING_LEVEL 0 //pending item is a known directory that needs its own level rescanned
+#define PENDING_TREE 1 //pending item is a new directory, its whole tree needs to be added
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define SINK_SIZE (1<<16) //size of per thread output buffer
+#define REC_DIR SCAN_DIR //record types: files total size of directory
+#define REC_SUBTREE SCAN_SUBTREE //inclusive size of subtree
+#define REC_REMOVED 2 //directory removed (watch mode)
+#define FMT_TEXT 0
+#define FMT_CSV 1
+#define FMT_JSON 2
+#define FMT_BIN 3
+#define FRAME_JOB 1 //frame types between coordinator and workers
+#define FRAME_STEAL 2
+#define FRAME_QUIT 3
+#define FRAME_RECS 4
+#define FRAME_STOLEN 5
+#define FRAME_DONE 6
+#define STEAL_BACKOFF_MS 50 //wait after a worker had nothing to give away before asking again
 #define CHECK(invoker, err_msg) { \
   if (invoker) { \
     fprintf(stderr, err_msg); \
 	exit(1); \
   } \
 }//macro to reduce redundant lines in main
-#define CHECK_THREAD(invoker, err_msg) { \
-  if (invoker) { \
-	if (name!=NULL)\
-		free(name); \
-	alive[serial]=0; \
-	__sync_fetch_and_sub(&total, 1);\
-	pthread_cond_signal(&empty);\
-	fprintf err_msg; \
-	pthread_exit((void*)1); \
-  } \
-} //macro to reduce redundant lines in thread_do.
-//condvar is signaled, in case this dying thread was the last one which all were waiting for.
 
-typedef struct n{
+typedef struct d{
 	char* name;
-	struct n* next;
-}node;
+	unsigned long size;
+} dir;
 
-typedef struct q{
-	node* head;
-	node* tail;
-}queue;
+typedef struct h{
+	dir* items; //min-heap by size, items[0] is the smallest directory kept
+	int len;
+}heap;
 
-typedef struct d{
+typedef struct dl{
+	dir* items; //growable array of directories (names are owned by list)
+	int len;
+	int cap;
+}dir_list;
+
+typedef struct we{
 	char* name;
 	unsigned long size;
-} dir;
+	int wd; //inotify watch descriptor, -1 if none (fanotify, or watch failed)
+	char dirty; //already pending a rescan
+	struct we* next; //next entry in same hash bucket
+}watch_entry;
 
+typedef struct s{
+	char* buf; //SINK_SIZE bytes of formatted records not written yet
+	size_t len;
+}sink;
+
+typedef struct fh{ //header of a frame between coordinator and workers
+	uint32_t len; //bytes following the header
+	uint32_t type; //FRAME_*
+}frame_header;
+
+typedef struct wk{
+	pid_t pid;
+	int fd; //coordinator's end of socket pair, -1 once worker is gone
+	int busy; //has a job
+	char* job; //path of its current job while busy, to name it if the worker dies
+	int stealing; //was asked to give away work and did not answer yet
+}worker;
+
+typedef struct bh{ //header of a record in bin format, followed by path_len bytes of path
+	uint64_t size;
+	uint32_t path_len;
+	uint32_t type;
+}bin_header;
 
 int init(int);
 void destroy();
+void destroy_tops();
 int register_sig();
-char* dequeue(int* done);
-int enque(char* , char*);
-void* thread_do();
-node* make_node(char* dir, char* buffer);
-void destroy_node(node* n);
-void destroy_q();
-void sig_handler(int signum, siginfo_t *info, void *ptr);
-void change_max(char* name, int size, long serial);
-int get_size(char* name, long serial);
-void clean_lock(void* lock);
+int take_signal();
+void stop_scan();
+void keep_top(heap* h, char* name, unsigned long size);
+void heap_sift_down(heap* h, int i);
+int cmp_dir(const void* a, const void* b);
+void print_top();
+int dir_list_add(dir_list* l, char* name, unsigned long size);
+void dir_list_free(dir_list* l);
+int watch_run(char* sock_path);
+int watch_notify_init(char* root);
+int watch_scanned(int thread, const char* path);
+int watch_seed();
+int watch_reconcile(char* path);
+void watch_notify_read();
+void watch_note(char* path, char* name, int isdir, int removed);
+void watch_flush();
+int watch_add_tree(char* path);
+int level_size(char* path, unsigned long* size, dir_list* children);
+watch_entry* watch_find(char* name);
+watch_entry* watch_insert(char* name, unsigned long size);
+void watch_remove(char* prefix);
+void watch_query(int fd);
+void watch_all_dirty();
+dir_list* watch_top();
+long now_ms();
+unsigned long hash_name(char* name);
+void destroy_watch();
+void emit(sink* s, int type, const char* name, unsigned long size);
+void sink_flush(sink* s);
+void write_all(int fd, char* buf, size_t len);
+int scan(char* path);
+int coordinate(char* path, int workers);
+int merge_recs(char* buf, uint32_t len);
+void retire_worker(worker* w, struct pollfd* fds, int i);
+void worker_main(int fd);
+void* worker_scan(void* path);
+void give_away();
+void send_job(void* arg, const char* path);
+int on_result(void* arg, int thread, int type, const char* path, unsigned long size);
+int add_child(void* list, const char* path);
+int send_frame(int fd, int type, char* buf, size_t len);
+char* read_frame(int fd, frame_header* h);
+int read_all(int fd, char* buf, size_t len);
+void print_stats(double seconds);
+long ns_since(struct timespec* start);
+void* report_do(void* start);
+void print_progress(char* label, struct timespec* start, struct timespec* since, unsigned long* prev, char* line);
+void destroy_sinks();
 
 int num = 0; //number of total user requested threads
-int idle = 0; //will count the number of idle threads
-int total = 0; //will count the total number of active threads (created and did not die)
-int finished = 0; //flag whether to keep waiting for new items in queue
-pthread_t* threads; //will hold array of threads
-char* alive = NULL; //alive[i] will keep a boolean attribute whether thread i is still alive
-queue q;
-dir max; //details of largest directory so far.
-pthread_mutex_t q_mutex; //access control for queue
-pthread_cond_t  empty; //wait if queue is empty
-pthread_mutex_t max_mutex; //access control for max struct
+int finished = 0; //flag raised by SIGINT
+int k = 1; //number of largest directories to report
+heap* tops = NULL; //tops[i] is thread i's private heap of the k largest directories it processed
+dir* largest_sub = NULL; //largest_sub[i] is the largest subtree (other than root) finished by thread i
+char* root_name = NULL; //path the scan started from, its own subtree is not a candidate for largest
+scan_options opts; //what the scan library is asked to do, set from the flags
+scan_ctx* ctx = NULL; //the scan, NULL until created
+char* watch_sock = NULL; //path of query socket in watch mode, NULL if not watching
+dir_list* scanned = NULL; //scanned[i] holds all directories scanned by thread i, to seed the watch table
+dir_list* changed = NULL; //changed[i] holds directories of thread i that changed before inotify watched them
+struct timespec watch_start; //when the watched scan started
+watch_entry** table = NULL; //hash table of watched directories by name (chained)
+unsigned long table_cap = 0; //number of buckets, power of 2
+unsigned long table_len = 0; //number of entries
+watch_entry** by_wd = NULL; //by_wd[wd] is the entry watched by inotify watch descriptor wd
+int wd_cap = 0;
+int notify_fd = -1; //fanotify or inotify descriptor
+int use_fanotify = 0; //which one of them notify_fd is
+int mount_fd = -1; //root directory, used to resolve fanotify file handles
+dir_list pending; //paths waiting for a rescan (size is PENDING_LEVEL or PENDING_TREE)
+dir_list top_cache; //K largest watched directories, valid unless top_stale
+int top_stale = 1;
+int format = FMT_TEXT; //format of records
+int quiet = 0; //flag whether to skip records
+FILE* report = NULL; //where summary goes, stdout unless records are in a machine format
+sink* sinks = NULL; //sinks[i] is output buffer of thread i, sinks[num] is main's (watch mode)
+pthread_mutex_t out_mutex; //makes every buffer flush one uninterrupted write
+int out_fd = STDOUT_FILENO; //where buffers are flushed, a socket to the coordinator in workers
+int in_worker = 0; //flag whether this process is a worker, buffers are sent as RECS frames
+int cross_mounts = 0; //flag whether disk usage may cross into other filesystems
+int show_stats = 0; //flag whether to print statistics
+int progress_every = -1; //seconds between progress lines, -1 if not requested (SIGUSR1 still prints one)
+int reporting = 0; //cleared to stop the reporter thread
+int sig_fd = -1; //signalfd of SIGINT and SIGUSR1, which are blocked in every thread
+char* state_path = NULL; //-R state file, NULL if not requested
+int resuming = 0; //flag whether the scan continues from state_path
+dir_list patterns; //-e and -I patterns until they are passed to the scan, size is 1 for -e
 
 int main(int argc, char* argv[]){
-	int tmp;
-	CHECK(register_sig(),"exiting..") //register signal handler for SIGINT (separated to reduce code bloat)
+	int tmp, opt;
+	char* name;
+	CHECK(register_sig(),"exiting..") //block SIGINT and SIGUSR1, they are read from sig_fd (separated to reduce code bloat)
 	//Check valid input and initialize structures
-	if (argc<3){
+	char root[PATH_MAX];
+	report = stdout;
+	int workers = 0, ret, excluding = 0, left;
+	struct timespec start, end;
+	scan_stats sum;
+	scan_options_init(&opts);
+	while ((opt = getopt(argc, argv, "k:ri:d:f:quXw:sp:e:I:m:xaoAR:")) != -1){
+		if (opt == 'k' && atoi(optarg) > 0){
+			k = atoi(optarg);
+		}
+		else if (opt == 'r'){
+			opts.inclusive = 1;
+		}
+		else if (opt == 'i'){
+			opts.index_path = optarg;
+		}
+		else if (opt == 'd'){
+			watch_sock = optarg;
+		}
+		else if (opt == 'q'){
+			quiet = 1;
+		}
+		else if (opt == 'u'){
+			opts.disk_usage = 1;
+		}
+		else if (opt == 'X'){
+			cross_mounts = 1;
+		}
+		else if (opt == 'w' && atoi(optarg) > 0){
+			workers = atoi(optarg);
+		}
+		else if (opt == 's'){
+			show_stats = 1;
+		}
+		else if (opt == 'p' && atoi(optarg) > 0){
+			progress_every = atoi(optarg);
+		}
+		else if (opt == 'e' || opt == 'I'){
+			CHECK(((name = strdup(optarg)) == NULL || dir_list_add(&patterns, name, opt == 'e')),"error allocating pattern\n");
+		}
+		else if (opt == 'm' && atoi(optarg) >= 0){
+			opts.max_depth = atoi(optarg);
+		}
+		else if (opt == 'x'){
+			opts.one_fs = 1;
+		}
+		else if (opt == 'a'){
+			opts.aggregate = 1;
+		}
+		else if (opt == 'o'){
+			opts.inode_order = 1;
+		}
+		else if (opt == 'A'){
+			opts.auto_threads = 1;
+		}
+		else if (opt == 'R'){
+			state_path = optarg;
+		}
+		else if (opt == 'f' && (strcmp(optarg, "text") == 0 || strcmp(optarg, "csv") == 0 ||
+				strcmp(optarg, "json") == 0 || strcmp(optarg, "bin") == 0)){
+			format = strcmp(optarg, "text") == 0 ? FMT_TEXT : strcmp(optarg, "csv") == 0 ? FMT_CSV :
+					strcmp(optarg, "json") == 0 ? FMT_JSON : FMT_BIN;
+			report = format == FMT_TEXT ? stdout : stderr;
+		}
+		else{
+			fprintf(stderr,"Usage <directory> <Number of threads> [-k K] [-r] [-i index] [-d socket] [-f text|csv|json|bin] [-q] [-u [-X]] [-w W] [-s] [-p S] [-e pattern] [-I pattern] [-m depth] [-x] [-a] [-o] [-A] [-R state]\n");
+			exit(1);
+		}
+	}
+	if (workers > 0 && (opts.inclusive || opts.index_path != NULL || watch_sock != NULL || opts.disk_usage || show_stats ||
+			progress_every > 0 || opts.aggregate)){
+		fprintf(stderr,"-r, -i, -d, -u, -s, -p and -a can't be used with -w\n");
+		exit(1);
+	}
+	if (opts.aggregate && opts.index_path != NULL){
+		fprintf(stderr,"-a needs every file statted, it can't be used with -i\n");
+		exit(1);
+	}
+	if (state_path != NULL && (opts.inclusive || opts.index_path != NULL || watch_sock != NULL || workers > 0)){
+		fprintf(stderr,"-R can't be used with -r, -i, -d or -w\n");
+		exit(1);
+	}
+	if (argc-optind<2){
 		fprintf(stderr,"Usage <directory> <Number of threads>, not enough variables\n");
 		exit(1);
 	}
-	num = atoi(argv[2]); //number of wanted threads
-	CHECK(init(num),"exiting.."); // initialize all locks, cond vars and thread array
-	CHECK(enque("",argv[1]+1),"exiting.."); //add home directory to queue, +1 as '/' will be added automatically by enqueue
-	//Start creating threads
-	long i=0;
-	while (i < num && !finished){ //create threads
-		__sync_fetch_and_add(&total, 1);// update one more created thread (will be used to tell if all threads are idle)
-		alive[i] = 1; //no need for atomicity, as only this thread will edit this slot
-		CHECK(pthread_create(threads+i,NULL,thread_do,(void*)i),"error in creating thread\n");
-		//printf("created thread %ld\n",i);
-		i++;
-	}
-	//Join all threads back
-	void* stat; //will hold exit code
-	int ret = 0; //keep track if any thread failed
-	int all = 0; //keep track if all failed
-	for (i=0 ; i<num ; i++){
-		stat = NULL; //see what this specific thread returned
-		tmp = pthread_join(threads[i], &stat);
-		if (tmp!=0 && tmp!=ESRCH){ //joined failed for other reason than thread does not exsist
-			destroy();
-			exit(1);
-		}
-		if (((long)stat)!=0 && (stat)!=PTHREAD_CANCELED){ //this thread returned 1 for failure.
-			ret = 1;
-			all++;
-		}
+	num = atoi(argv[optind+1]); //number of wanted threads
+	if (strcmp(argv[optind+1], "auto") == 0){
+		opts.auto_threads = 1;
+		num = 4 * sysconf(_SC_NPROCESSORS_ONLN);
 	}
-	if (all==num){ //all threads failed
-		puts("All threads died :(");
+	CHECK((num < 1),"Number of threads should be positive\n");
+	CHECK(init(num),"exiting.."); // initialize output buffers, heaps and locks
+	opts.threads = num;
+	opts.one_fs = opts.one_fs || (opts.disk_usage && !cross_mounts);
+	opts.callback = on_result;
+	if ((ctx = scan_create(&opts)) == NULL){
 		destroy();
 		exit(1);
 	}
-	if (finished){ //This flag is raised by a SIGINT
-		printf("Search stopped");
+	for (tmp=0 ; tmp<patterns.len ; tmp++){
+		CHECK(((patterns.items[tmp].size ? scan_exclude : scan_include)(ctx, patterns.items[tmp].name)),"error allocating pattern\n");
+		excluding |= patterns.items[tmp].size;
 	}
-	else{
-		printf("Done traversing the sub-tree");
+	dir_list_free(&patterns);
+	if (watch_sock != NULL){ //events report canonical paths, so names must be canonical too
+		CHECK((realpath(argv[optind], root) == NULL),"error resolving directory\n");
+		argv[optind] = root;
+	}
+	root_name = argv[optind];
+	CHECK((scan_set_root(ctx, root_name)),"exiting..\n");
+	resuming = state_path != NULL && access(state_path, F_OK) == 0;
+	if (format == FMT_CSV && !quiet){
+		write_all(out_fd, "type,size,path\n", 15);
+	}
+	if (watch_sock != NULL && watch_notify_init(root_name)){ //before the scan, so no change made during it is lost
+		destroy();
+		exit(1);
 	}
-	if (max.name==NULL){
-		puts(" no dir processed yet :(");
+	if (workers > 0){
+		ret = coordinate(root_name, workers);
 	}
 	else{
-		printf(", directory %s has the largest files size of %lu bytes \n", basename(max.name), max.size);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = scan(root_name);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (show_stats){
+			print_stats((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+		}
+	}
+	if (ret == 2){ //all threads failed
+		fputs("All threads died :(\n", report);
+		destroy();
+		exit(1);
+	}
+	print_top();
+	if (state_path != NULL && finished){
+		if (scan_save_state(ctx, state_path)){
+			ret = 1;
+		}
+		else{
+			scan_queue_state(ctx, &left, &tmp, &tmp);
+			fprintf(report,"Stopped with %d directories left, saved to %s (run again with -R %s to continue)\n",
+					left, state_path, state_path);
+		}
+	}
+	else if (resuming && ret == 0){
+		unlink(state_path); //all of it was scanned
+	}
+	if (opts.disk_usage){
+		fprintf(report,"Disk usage: %lu repeated hard links were counted once\n", scan_hardlink_dups(ctx));
+	}
+	if (workers == 0 && (excluding || opts.max_depth >= 0 || opts.one_fs)){ //workers keep their counters
+		scan_get_stats(ctx, -1, &sum);
+		fprintf(report,"Pruned: %lu directories by pattern, %lu by depth, %lu on other filesystems\n", sum.pruned_match,
+				sum.pruned_depth, sum.pruned_mount);
+	}
+	if (workers == 0){
+		scan_tune_report(ctx, report);
+	}
+	if (opts.aggregate){
+		scan_aggregate_report(ctx, report);
+	}
+	if (opts.index_path != NULL){
+		scan_index_report(ctx, report);
+		if (!finished && scan_index_save(ctx)){ //interrupted scan would drop unvisited directories from index
+			ret = 1;
+		}
+	}
+	if (watch_sock != NULL && !finished){
+		fflush(stdout);
+		if (watch_seed() || watch_run(watch_sock)){
+			ret = 1;
+		}
 	}
 	destroy();
 	exit(ret); //if we reached this all threads were already joined (no fear that this will terminate prematurely)
 }
 
 /*
- * Logic for thread tasks.
- * Notice that no data is allocated by this function, but:
- * it is responsible for the name string it dequeued (free it or pass it to the max struct).
- * Logic:
- * 	untill caceled or get flag that all threads are idle, dequeue a dir name
- * 	(dedque will block untill queue is not empty, note that thread is open to cancelation waiting for queue to fill)
- * 	call get_size to sum directory file sizes (this function also queues new dirs it encounters)
- * 	call change_max to compare this dir's size to current largest.
- * 	before continuing to next dir, check if we need to be canceled.
- *
+ * Scans the tree under path with the library, while the reporter thread prints progress.
+ * Can be called again after it returned (workers scan one job after the other).
+ * Returns 0 on success, 1 if some thread failed, 2 if all of them did.
+ */
+int scan(char* path){
+	int i, ret;
+	pthread_t reporter;
+	struct timespec start;
+	char* line;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	reporting = 1;
+	CHECK(pthread_create(&reporter,NULL,report_do,&start),"error in creating reporter thread\n");
+	ret = resuming ? scan_resume(ctx, state_path) : scan_run(ctx, path);
+	reporting = 0;
+	pthread_kill(reporter, SIGUSR1); //wakes it from poll on sig_fd to see it should stop
+	pthread_join(reporter, NULL);
+	if (progress_every > 0 && (line = malloc(320 + 24 * num)) != NULL){
+		print_progress("Final", &start, &start, NULL, line);
+		free(line);
+	}
+	fflush(stdout);
+	for (i=0 ; i<num ; i++){ //whatever threads left in their buffers
+		sink_flush(sinks + i);
+	}
+	return ret;
+}
+
+/*
+ * Result callback of the scan, runs in scanning thread "thread" (see top of file).
+ * Formats the record, keeps the directory for watch mode, and offers it to the thread's heap (or its subtree to the
+ * thread's largest subtree). Names are copied only when kept, as path belongs to the library.
+ * Returns 0 on success, 1 on allocation failure.
+ */
+int on_result(void* arg, int thread, int type, const char* path, unsigned long size){
+	char* copy;
+	heap* top = tops + thread;
+	emit(sinks + thread, type, path, size);
+	if (type == SCAN_SUBTREE){
+		if (strcmp(path, root_name) != 0 && (size > largest_sub[thread].size || largest_sub[thread].name == NULL)){
+			if ((copy = strdup(path)) == NULL){
+				return 1;
+			}
+			free(largest_sub[thread].name);
+			largest_sub[thread].name = copy;
+			largest_sub[thread].size = size;
+		}
+		return 0;
+	}
+	if (watch_sock != NULL && ((copy = strdup(path)) == NULL || dir_list_add(scanned + thread, copy, size) ||
+			watch_scanned(thread, path))){
+		return 1;
+	}
+	if (top->len < k || size > top->items[0].size){ //copy only candidates
+		if ((copy = strdup(path)) == NULL){
+			return 1;
+		}
+		keep_top(top, copy, size);
+	}
+	return 0;
+}
+
+/*
+ * Coordinator side of -w: forks workers, hands out jobs, rebalances and merges results (see top of file).
+ * Root's own level is scanned here, its sub directories are the first jobs.
+ * Returns 0 on success, 1 if any worker failed.
  */
-void* thread_do(void* i){
-	pthread_testcancel();
-	long serial = (long) i; //this thread's serial number
-	int done = 0; //dequeue will change to 1 when all threads become idle and program needs to finish
-	char* name = NULL;
+int coordinate(char* path, int workers){
+	worker* w = calloc(workers, sizeof(worker));
+	struct pollfd* fds = calloc(workers + 1, sizeof(struct pollfd)); //and sig_fd last
+	dir_list jobs = {NULL, 0, 0};
+	frame_header h;
+	char* root = strdup(path), *buf;
+	int i, j, sv[2], ret = 0, live = 0, timeout, next_steal = 0, busy, idle_workers, stealing;
 	unsigned long size;
-	CHECK_THREAD((pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL)),(stderr,"error checking cancel, thread %ld\n",serial));
-	while (1){
-		name = dequeue(&done);
-		if ((name == NULL)){
-			if (done){
+	long steal_after = 0;
+	if (w == NULL || fds == NULL || root == NULL){
+		fprintf(stderr,"error allocating workers\n");
+		free(w);
+		free(fds);
+		free(root);
+		return 1;
+	}
+	if (level_size(root, &size, &jobs)){
+		fprintf(stderr,"error reading dir %s, errno %d\n",root,errno);
+		ret = 1;
+		goto out;
+	}
+	fflush(stdout); //or workers would print it again on exit
+	fflush(stderr);
+	signal(SIGPIPE, SIG_IGN); //a worker that died makes sending to it fail, instead of killing the coordinator
+	for (i=0 ; i<workers ; i++){
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) || (w[i].pid = fork()) < 0){
+			fprintf(stderr,"error starting worker %d, errno %d\n",i,errno);
+			ret = 1;
+			goto out;
+		}
+		if (w[i].pid == 0){ //worker, never returns
+			close(sv[0]);
+			for (j=0 ; j<i ; j++){
+				close(w[j].fd);
+			}
+			worker_main(sv[1]);
+		}
+		close(sv[1]);
+		w[i].fd = fds[i].fd = sv[0];
+		fds[i].events = POLLIN;
+		live++;
+	}
+	emit(sinks + num, REC_DIR, root, size);
+	keep_top(tops, root, size); //root is owned by heap now
+	root = NULL;
+	while (!finished){
+		for (i=0 ; i<workers && jobs.len>0 ; i++){ //hand out jobs, deepest last so pool works like a stack
+			if (w[i].fd >= 0 && !w[i].busy){
+				if (send_frame(w[i].fd, FRAME_JOB, jobs.items[jobs.len-1].name, strlen(jobs.items[jobs.len-1].name))){
+					fprintf(stderr,"error sending job to worker %d, errno %d\n",i,errno); //job stays in the pool
+					retire_worker(w, fds, i);
+					live--;
+					ret = 1;
+					continue;
+				}
+				jobs.len--;
+				w[i].job = jobs.items[jobs.len].name; //owned by the worker entry now
+				w[i].busy = 1;
+			}
+		}
+		busy = idle_workers = stealing = 0;
+		for (i=0 ; i<workers ; i++){
+			busy += w[i].fd >= 0 && w[i].busy;
+			idle_workers += w[i].fd >= 0 && !w[i].busy;
+			stealing += w[i].stealing;
+		}
+		if (busy == 0 && (jobs.len == 0 || live == 0)){ //nothing left (or nobody left to do it)
+			break;
+		}
+		if (jobs.len == 0 && idle_workers > 0 && !stealing && now_ms() >= steal_after){
+			for (i=0 ; i<workers ; i++){ //round robin over busy workers
+				next_steal = (next_steal + 1) % workers;
+				if (w[next_steal].fd >= 0 && w[next_steal].busy){
+					w[next_steal].stealing = send_frame(w[next_steal].fd, FRAME_STEAL, NULL, 0) == 0;
+					break;
+				}
+			}
+		}
+		timeout = steal_after > now_ms() ? (int)(steal_after - now_ms()) : 1000;
+		fds[workers].fd = sig_fd;
+		fds[workers].events = POLLIN;
+		if (poll(fds, workers + 1, timeout) < 0 && errno != EINTR){
+			fprintf(stderr,"error in poll, errno %d\n",errno);
+			ret = 1;
+			break;
+		}
+		if (fds[workers].revents & POLLIN){
+			take_signal();
+		}
+		for (i=0 ; i<workers ; i++){
+			if (w[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP))){
+				continue;
+			}
+			if ((buf = read_frame(w[i].fd, &h)) == NULL){ //worker died, what it still had queued of its job is lost
+				if (w[i].busy){
+					fprintf(stderr,"worker %d exited unexpectedly, sizes under %s are incomplete\n",i,w[i].job);
+				}
+				else{
+					fprintf(stderr,"worker %d exited unexpectedly\n",i);
+				}
+				retire_worker(w, fds, i);
+				live--;
+				ret = 1;
+				continue;
+			}
+			switch (h.type){
+			case FRAME_RECS:
+				ret |= merge_recs(buf, h.len);
+				break;
+			case FRAME_JOB:
+				if (dir_list_add(&jobs, buf, 0)){
+					fprintf(stderr,"error keeping given away job\n");
+					ret = 1;
+				}
+				buf = NULL; //owned by job list
+				break;
+			case FRAME_STOLEN:
+				w[i].stealing = 0;
+				if (jobs.len == 0){ //had nothing to give
+					steal_after = now_ms() + STEAL_BACKOFF_MS;
+				}
+				break;
+			case FRAME_DONE:
+				w[i].busy = 0;
+				free(w[i].job);
+				w[i].job = NULL;
 				break;
 			}
-			else{ //error in dequeue
-				alive[serial]=0; //update that this thread is dead
-				__sync_fetch_and_sub(&total, 1); //update that there is one less thread
-				fprintf(stderr,"error in dequeue for thread %ld \n",serial); //c, no resources to release
-				return (void*)1;
+			free(buf);
+		}
+	}
+out:
+	for (i=0 ; i<workers ; i++){
+		if (w[i].fd >= 0 && w[i].pid > 0){
+			send_frame(w[i].fd, FRAME_QUIT, NULL, 0);
+			while ((buf = read_frame(w[i].fd, &h)) != NULL){ //a busy worker (interrupted) stops, and flushes its records
+				if (h.type == FRAME_RECS){
+					ret |= merge_recs(buf, h.len);
+				}
+				free(buf);
 			}
+			close(w[i].fd);
+		}
+		if (w[i].pid > 0 && waitpid(w[i].pid, &j, 0) == w[i].pid && (!WIFEXITED(j) || WEXITSTATUS(j) != 0)){
+			ret = 1;
 		}
-		size = get_size(name, serial);
-		printf("%s, files total size: %lu\n", name, size); //c, name will be freed on cleaner
-		change_max(name,size,serial); //test if this dir is the largest so far, frees the unused
-		name = NULL; //either freed by change max or is now owned by max struct
-		CHECK_THREAD((pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL)),(stderr,"error checking cancel, thread %ld\n",serial));
-		pthread_testcancel();
-		CHECK_THREAD((pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL)),(stderr,"error checking cancel, thread %ld\n",serial));
+		free(w[i].job); //busy when interrupted
 	}
-	return (void*)0;
+	sink_flush(sinks + num);
+	if (jobs.len > 0 && !finished){
+		ret = 1;
+	}
+	dir_list_free(&jobs);
+	free(root);
+	free(w);
+	free(fds);
+	return ret;
+}
+
+/*
+ * Stops using worker i of the coordinator after its socket failed: closes the coordinator's end, so it is no longer
+ * polled or handed jobs. The process itself is reaped when the coordinator finishes.
+ */
+void retire_worker(worker* w, struct pollfd* fds, int i){
+	close(w[i].fd);
+	w[i].fd = fds[i].fd = -1;
+	w[i].busy = w[i].stealing = 0;
+	free(w[i].job);
+	w[i].job = NULL;
+}
+
+/*
+ * Merges a RECS frame of len bytes from a worker: every record is emitted to main's sink and offered to the K largest.
+ * Returns 0 on success, 1 if a record could not be allocated or the frame is malformed (the rest of it is dropped).
+ */
+int merge_recs(char* buf, uint32_t len){
+	bin_header rec;
+	char* p, *name;
+	int ret = 0;
+	for (p = buf ; p + sizeof(rec) <= buf + len ; p += sizeof(rec) + rec.path_len){
+		memcpy(&rec, p, sizeof(rec));
+		if (rec.path_len > (size_t)(buf + len - p) - sizeof(rec) || rec.path_len > PATH_MAX-1){ //short or corrupt frame
+			fprintf(stderr,"malformed record from worker, dropping the rest of the frame\n");
+			return 1;
+		}
+		if ((name = malloc(rec.path_len + 1)) == NULL){
+			fprintf(stderr,"error allocating record\n");
+			ret = 1;
+			continue;
+		}
+		memcpy(name, p + sizeof(rec), rec.path_len);
+		name[rec.path_len] = '\0';
+		emit(sinks + num, rec.type, name, rec.size);
+		keep_top(tops, name, rec.size);
+	}
+	return ret;
 }
 
 /*
- * Goes over all files in directory "name", and sums their sizes.
- * directory sizes are not summed, but instead inserted into queue (except root and father pointers: "." "..")
- * This function contains cancellation points which are handled clean up function to close open dir and release directory name
+ * Worker side of -w, runs in a forked process and exits when done.
+ * Main thread only reads frames: a job is scanned by a scan thread (so that give away requests are still answered
+ * while scanning), which reports DONE when finished. Records reach the coordinator through the usual buffers.
  */
-int get_size(char* name, long serial){
-	int size = 0;
-	struct stat info;
-	struct dirent *entry;
-	DIR *cur= NULL;
-	CHECK_THREAD((!(cur = opendir(name))),(stderr,"error opening dir %s thread %ld\n",name,serial)); //c
-	errno = 0; //Distinguish errors for dir
-	while ((entry = readdir(cur)) != NULL){ //get files in dir
-		//handle if current file is another dir
-		if (entry->d_type == DT_DIR){
-			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+void worker_main(int fd){
+	frame_header h;
+	char* buf;
+	pthread_t scanner;
+	int scanning = 0, ret = 0;
+	void* stat;
+	out_fd = fd;
+	in_worker = 1;
+	signal(SIGPIPE, SIG_IGN); //an interrupted coordinator may close its end first, writes just fail then
+	sinks[num].len = 0; //coordinator's buffer, inherited by fork
+	format = FMT_BIN;
+	quiet = 0;
+	while ((buf = read_frame(fd, &h)) != NULL && h.type != FRAME_QUIT){
+		if (h.type == FRAME_JOB){
+			if (scanning){ //previous job already reported DONE, so this is quick
+				pthread_join(scanner, &stat);
+				ret |= (long)stat;
+			}
+			if (pthread_create(&scanner, NULL, worker_scan, buf)){
+				fprintf(stderr,"error creating scan thread\n");
+				send_frame(fd, FRAME_DONE, NULL, 0);
+				free(buf);
+				ret = 1;
 				continue;
 			}
-			else{
-				CHECK_THREAD((enque(name,entry->d_name)),(stderr,"error adding dir %s to queue thread %ld\n",entry->d_name,serial)); //note this actualy adds new directory to dir
+			scanning = 1;
+			continue; //buf is freed by scan thread
+		}
+		if (h.type == FRAME_STEAL){
+			give_away();
+		}
+		free(buf);
+	}
+	free(buf);
+	if (scanning){
+		scan_cancel(ctx); //a QUIT while scanning means the coordinator was interrupted, otherwise the scan is done
+		pthread_join(scanner, &stat);
+		ret |= (long)stat;
+	}
+	close(fd);
+	destroy();
+	exit(ret);
+}
+
+/*
+ * Scan thread of a worker: scans one job (path is a full path, freed here) and reports DONE.
+ */
+void* worker_scan(void* path){
+	long ret = scan((char*)path) != 0;
+	free(path);
+	if (send_frame(out_fd, FRAME_DONE, NULL, 0)){
+		ret = 1;
+	}
+	return (void*)ret;
+}
+
+/*
+ * Gives away half of this worker's queue (the oldest, shallowest directories) to the coordinator, then STOLEN.
+ */
+void give_away(){
+	scan_give_away(ctx, send_job, NULL);
+	send_frame(out_fd, FRAME_STOLEN, NULL, 0);
+}
+
+/*
+ * Sends a directory given away to the coordinator as a JOB frame.
+ */
+void send_job(void* arg, const char* path){
+	send_frame(out_fd, FRAME_JOB, (char*)path, strlen(path));
+}
+
+/*
+ * Sends one frame (header and len bytes of buf) as one uninterrupted write.
+ * Returns 0 on success, 1 otherwise.
+ */
+int send_frame(int fd, int type, char* buf, size_t len){
+	frame_header h;
+	struct iovec iov[2];
+	ssize_t n;
+	h.len = len;
+	h.type = type;
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	pthread_mutex_lock(&out_mutex);
+	while (iov[0].iov_len + iov[1].iov_len > 0){
+		if ((n = writev(fd, iov, 2)) < 0){
+			if (errno == EINTR){
+				continue;
 			}
+			pthread_mutex_unlock(&out_mutex);
+			fprintf(stderr,"error sending frame, errno %d\n",errno);
+			return 1;
+		}
+		if ((size_t)n >= iov[0].iov_len){ //header is out, advance in buf
+			n -= iov[0].iov_len;
+			iov[0].iov_len = 0;
+			iov[1].iov_base = (char*)iov[1].iov_base + n;
+			iov[1].iov_len -= n;
+		}
+		else{
+			iov[0].iov_base = (char*)iov[0].iov_base + n;
+			iov[0].iov_len -= n;
 		}
-		//if a regular file
-		else if (entry->d_type == DT_REG){
-			CHECK_THREAD((fstatat(dirfd(cur), entry->d_name, &info, 0)),(stderr,"error getting stat info on file %s, thread %ld, errno %d\n",entry->d_name,serial,errno));
-			size += info.st_size;
+	}
+	pthread_mutex_unlock(&out_mutex);
+	return 0;
+}
+
+/*
+ * Reads one frame from fd. Returns its payload (null terminated, so it can be used as a path) and fills h.
+ * Returns NULL on error or end of file.
+ */
+char* read_frame(int fd, frame_header* h){
+	char* buf;
+	if (read_all(fd, (char*)h, sizeof(*h)) || (buf = malloc(h->len + 1)) == NULL){
+		return NULL;
+	}
+	if (read_all(fd, buf, h->len)){
+		free(buf);
+		return NULL;
+	}
+	buf[h->len] = '\0';
+	return buf;
+}
+
+/*
+ * read() until all len bytes were read. Returns 0 on success, 1 on error or end of file.
+ */
+int read_all(int fd, char* buf, size_t len){
+	ssize_t n;
+	while (len > 0){
+		if ((n = read(fd, buf, len)) <= 0){
+			if (n < 0 && errno == EINTR){
+				continue;
+			}
+			return 1;
 		}
+		buf += n;
+		len -= n;
 	}
-	CHECK_THREAD((errno!=0),(stderr,"error while readdir on %s, thread %ld errno %d \n",name,serial,errno));
-	CHECK_THREAD(closedir(cur),(stderr,"error closing dir"));
-	return size;
+	return 0;
 }
 
 /*
- * Checks if directory "name" has the largest file sizes so far.
- * Frees the "loser" directory name (as it is no longer needed)
- * Note that as Macro Check_THREAD is used, in mutex error- this function will cleanup for thread and pthread_exit.
- * Only cancel point in this function is in the CHECK_THREAD function and means we already cleaned up and ready to exit.
+ * Merges the per thread heaps into the heap of thread 0 and prints the results.
+ * Only called after all threads were joined, so no locking is needed.
  */
-void change_max(char* name, int size, long serial){
-	CHECK_THREAD(pthread_mutex_lock(&max_mutex),(stderr,"error acquiring max lock thread %ld",serial));
-	if (max.size < size){
-		if (max.name!=NULL){
-			free(max.name);
+void print_top(){
+	int i, j;
+	dir tmp;
+	heap* all = tops; //tops[0] collects the k largest of all threads
+	for (i=1 ; i<num ; i++){
+		for (j=0 ; j<tops[i].len ; j++){
+			keep_top(all, tops[i].items[j].name, tops[i].items[j].size); //passes ownership of the name
 		}
-		max.name = name;
-		max.size = size;
+		tops[i].len = 0;
+	}
+	qsort(all->items, all->len, sizeof(dir), cmp_dir); //largest first, heap order is no longer needed
+	if (finished){ //This flag is raised by a SIGINT
+		fprintf(report,"Search stopped");
 	}
 	else{
-		free(name);
+		fprintf(report,"Done traversing the sub-tree");
+	}
+	if (all->len==0){
+		fputs(" no dir processed yet :(\n", report);
+		return;
+	}
+	fprintf(report,", directory %s has the largest files size of %lu bytes \n", basename(all->items[0].name), all->items[0].size);
+	if (k>1){
+		fprintf(report,"Top %d directories:\n", all->len);
+		for (i=0 ; i<all->len ; i++){
+			fprintf(report,"%d. %s, files total size: %lu\n", i+1, all->items[i].name, all->items[i].size);
+		}
+	}
+	if (opts.inclusive){
+		for (i=1 ; i<num ; i++){
+			if (largest_sub[i].size > largest_sub[0].size){ //swap, so each name is still owned (and freed) once
+				tmp = largest_sub[0];
+				largest_sub[0] = largest_sub[i];
+				largest_sub[i] = tmp;
+			}
+		}
+		if (!finished){ //root total is only known once the whole tree finished
+			fprintf(report,"Total size of sub-tree: %lu bytes\n", scan_root_total(ctx));
+		}
+		if (largest_sub[0].name != NULL){
+			fprintf(report,"Largest subtree is %s with %lu bytes\n", largest_sub[0].name, largest_sub[0].size);
+		}
 	}
-	CHECK_THREAD(pthread_mutex_unlock(&max_mutex),(stderr,"error releasing max lock thread %ld",serial));
 }
 
 /*
- * Takes a node out of the queue and returns a pointer to the string it contained.
- * Recieves a pointer to a flag "done" to signal that the returned value was 0 not due to an error (work is done)
- *
- * If the queue is empty, this thread will wait for cond var empty.
- * The is all threads but one are idle, this thread will not wait as well but wake every body up as work is done.
- *
- * This function contain one of two cancelable points in a threads life: we want all idle threads waiting for convar.
- * to be canceled (otherwise they might never wake). But if they just cancel they will leave the lock as.
- * To deal with this a cleanup function was pushed.
- *
+ * Checks if directory "name" is among the k largest in heap h.
+ * Frees the "loser" directory name (either this one or the smallest kept so far, as it is no longer needed)
+ * The heap is private to one thread (or used by main after join), so there is no locking and no cancel point here.
  */
-char* dequeue(int *done){
-	char *name = NULL;
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL); //DD
-	if (pthread_mutex_lock(&q_mutex)){ //failed acquiring mutex
-		fprintf(stderr,"error in dequeue mutex acquire");
-		return NULL;
+void keep_top(heap* h, char* name, unsigned long size){
+	int i, parent;
+	if (h->len == k){
+		if (h->items[0].size >= size){ //common case, smaller than everything we keep
+			free(name);
+			return;
+		}
+		free(h->items[0].name); //replace the smallest and restore heap order
+		h->items[0].name = name;
+		h->items[0].size = size;
+		heap_sift_down(h, 0);
+		return;
 	}
-	pthread_cleanup_push(clean_lock,&q_mutex); //DD
-	while (EMPTY && !(ALL_IDLE)){
-		//printf("going to sleep, already %d waiting out of %d threads\n",idle,total); //c
-		idle++; //update counter that this thread is also idle, okay to increment since we are under a lock
-		pthread_cond_wait(&empty, &q_mutex); //c
-		idle--; //update counter that this thread is also idle, okay to decrement since we are under a lock
-		//printf("woke, already %d waiting out of %d threads\n",idle,total);//c
-	}
-	pthread_cleanup_pop(0); //DD
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL); //DD
-	if (EMPTY && LAST){ //all threads finished working
-		pthread_cond_broadcast(&empty);
-		idle = idle + 2; //so waking threads still know we are done (they decrement idle when they exit- this way they know a different thread finished)
-	}
-	if ((EMPTY && ALL_IDLE)){
-		idle++; //to cancel decrement action going out of while loop
-		if (pthread_mutex_unlock(&q_mutex)){
-			fprintf(stderr,"error in dequeue mutex release"); //c (doesn't matter as means release failed)
-			return NULL;
+	i = h->len++; //heap is not full yet, sift new item up
+	while (i > 0 && h->items[(parent = (i-1)/2)].size > size){
+		h->items[i] = h->items[parent];
+		i = parent;
+	}
+	h->items[i].name = name;
+	h->items[i].size = size;
+}
+
+/*
+ * Moves item i down until both its children are larger (standard min-heap fix up).
+ */
+void heap_sift_down(heap* h, int i){
+	int child;
+	dir tmp = h->items[i];
+	while ((child = 2*i+1) < h->len){
+		if (child+1 < h->len && h->items[child+1].size < h->items[child].size){
+			child++;
+		}
+		if (tmp.size <= h->items[child].size){
+			break;
 		}
-		*done = 1; //signal caller we finished working
+		h->items[i] = h->items[child];
+		i = child;
+	}
+	h->items[i] = tmp;
+}
+
+/*
+ * qsort comparator, orders directories from largest to smallest.
+ */
+int cmp_dir(const void* a, const void* b){
+	unsigned long x = ((dir*)a)->size, y = ((dir*)b)->size;
+	return (x < y) - (x > y);
+}
+
+/*
+ * Returns nanoseconds passed since start (CLOCK_MONOTONIC).
+ */
+long ns_since(struct timespec* start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Reporter thread of scan(), start is when the scan started (see top of file). Also takes SIGINT from sig_fd.
+ * Stops when reporting is cleared and it is sent a SIGUSR1.
+ */
+void* report_do(void* start){
+	struct pollfd p;
+	struct timespec since = *(struct timespec*)start;
+	unsigned long* prev = calloc(num, sizeof(unsigned long)); //dirs of each thread at previous line
+	char* line = malloc(320 + 24 * num);
+	int sig;
+	if (prev == NULL || line == NULL){
+		fprintf(stderr,"error allocating progress reporter, no progress will be printed\n");
+		free(prev);
+		free(line);
 		return NULL;
 	}
-	if (q.head==NULL){
-		pthread_mutex_unlock(&q_mutex);
+	p.fd = sig_fd;
+	p.events = POLLIN;
+	while (reporting){
+		sig = poll(&p, 1, progress_every > 0 ? progress_every * 1000 : -1);
+		sig = sig > 0 ? take_signal() : sig;
+		if (!reporting){
+			break;
+		}
+		if (sig == SIGUSR1 || (sig == 0 && progress_every > 0)){ //asked for, or timed out
+			print_progress("Progress", start, &since, prev, line);
+		}
+	}
+	free(prev);
+	free(line);
+	return NULL;
+}
+
+/*
+ * Prints one progress line to stderr: totals since start, and dirs/s of each thread since "since".
+ * prev holds each thread's dirs at "since" (NULL means 0), and is updated along with since.
+ * line is a buffer of at least 320 + 24 * num bytes, so the line goes out in one write.
+ */
+void print_progress(char* label, struct timespec* start, struct timespec* since, unsigned long* prev, char* line){
+	int i, len, queued, idle, total;
+	unsigned long dirs;
+	double elapsed = ns_since(start) / 1e9, window = ns_since(since) / 1e9;
+	scan_stats sum, one;
+	scan_get_stats(ctx, -1, &sum);
+	scan_queue_state(ctx, &queued, &idle, &total);
+	len = sprintf(line,"%s %.1f s: %lu dirs, %lu files, %lu bytes, queue %d, idle %d/%d, lock wait %.1f ms, "
+			"empty wait %.1f ms, ", label, elapsed, sum.dirs, sum.files, sum.bytes, queued, idle, total,
+			sum.lock_wait_ns / 1e6, sum.empty_wait_ns / 1e6);
+	if (opts.auto_threads){
+		len += sprintf(line + len, "limit %d, %.1f us/op, ", scan_thread_limit(ctx), sum.ops ? sum.op_ns / 1e3 / sum.ops : 0);
+	}
+	len += sprintf(line + len, "dirs/s per thread:");
+	for (i=0 ; i<num ; i++){
+		scan_get_stats(ctx, i, &one);
+		dirs = one.dirs;
+		len += sprintf(line + len, " %.0f", window > 0 ? (dirs - (prev ? prev[i] : 0)) / window : 0);
+		if (prev != NULL){
+			prev[i] = dirs;
+		}
+	}
+	line[len++] = '\n';
+	write_all(STDERR_FILENO, line, len);
+	clock_gettime(CLOCK_MONOTONIC, since);
+}
+
+/*
+ * Sums the counters of all threads and prints them to stderr, in one line that scripts can parse.
+ */
+void print_stats(double seconds){
+	scan_stats sum;
+	scan_get_stats(ctx, -1, &sum);
+	fprintf(stderr,"Stats: %lu dirs, %lu files, %lu bytes in %.6f s (%.0f dirs/s, %.0f files/s), empty wait %.3f ms, "
+			"queue lock wait %.3f ms\n", sum.dirs, sum.files, sum.bytes, seconds, sum.dirs / seconds, sum.files / seconds,
+			sum.empty_wait_ns / 1e6, sum.lock_wait_ns / 1e6);
+}
+
+/*
+ * Appends a directory to a growable list, taking ownership of name.
+ * Returns 0 on success, 1 otherwise (name is freed then).
+ */
+int dir_list_add(dir_list* l, char* name, unsigned long size){
+	dir* tmp;
+	if (l->len == l->cap){
+		l->cap = l->cap ? 2*l->cap : 64;
+		if ((tmp = realloc(l->items, l->cap * sizeof(dir))) == NULL){
+			free(name);
+			return 1;
+		}
+		l->items = tmp;
+	}
+	l->items[l->len].name = name;
+	l->items[l->len++].size = size;
+	return 0;
+}
+
+/*
+ * Frees a list and all names in it, leaving it empty and reusable.
+ */
+void dir_list_free(dir_list* l){
+	int i;
+	for (i=0 ; i<l->len ; i++){
+		free(l->items[i].name);
+	}
+	free(l->items);
+	l->items = NULL;
+	l->len = 0;
+	l->cap = 0;
+}
+
+/*
+ * Returns milliseconds of monotonic clock, for coalescing events.
+ */
+long now_ms(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/*
+ * String hash (FNV-1a) for the watch table.
+ */
+unsigned long hash_name(char* name){
+	unsigned long h = 14695981039346656037UL;
+	while (*name){
+		h = (h ^ (unsigned char)*name++) * 1099511628211UL;
+	}
+	return h;
+}
+
+/*
+ * Finds the watch entry of directory name, NULL if not watched.
+ */
+watch_entry* watch_find(char* name){
+	watch_entry* e;
+	if (table == NULL){
 		return NULL;
 	}
-	//done with all the Sh*t, now this is a normal dequeue assuming the queue is not empty, no cpoints until end of code
-	node* tmp = q.head; //Guaranteed not to be NULL
-	q.head = (q.head)->next;
-	if EMPTY{
-		q.tail = NULL;
+	for (e = table[hash_name(name) & (table_cap-1)] ; e != NULL ; e = e->next){
+		if (strcmp(e->name, name) == 0){
+			return e;
+		}
 	}
-	if (pthread_mutex_unlock(&q_mutex)){
-		destroy_node(tmp); //free node that was taken out.
-		fprintf(stderr,"error in dequeue mutex release"); //cancelation point, but mutex failed to be freed anyway
+	return NULL;
+}
+
+/*
+ * Adds directory name to watch table (taking ownership of name), and an inotify watch for it if inotify is used.
+ * Table is doubled when it has more entries than buckets.
+ * Returns the new entry, or NULL on allocation failure (name is freed then).
+ */
+watch_entry* watch_insert(char* name, unsigned long size){
+	unsigned long i, b;
+	watch_entry** tmp, *e, *nxt;
+	if (table_len >= table_cap){ //grow and rehash
+		b = table_cap ? 2*table_cap : 1024;
+		if ((tmp = calloc(b, sizeof(watch_entry*))) == NULL){
+			free(name);
+			return NULL;
+		}
+		for (i=0 ; i<table_cap ; i++){
+			for (e = table[i] ; e != NULL ; e = nxt){
+				nxt = e->next;
+				e->next = tmp[hash_name(e->name) & (b-1)];
+				tmp[hash_name(e->name) & (b-1)] = e;
+			}
+		}
+		free(table);
+		table = tmp;
+		table_cap = b;
+	}
+	if ((e = calloc(1, sizeof(watch_entry))) == NULL){
+		free(name);
 		return NULL;
 	}
-	name = tmp->name;
-	free(tmp); //free node that was taken out, note that we keep the allocated string
-	return name;
+	e->name = name;
+	e->size = size;
+	e->wd = -1;
+	b = hash_name(name) & (table_cap-1);
+	e->next = table[b];
+	table[b] = e;
+	table_len++;
+	top_stale = 1;
+	if (!use_fanotify && notify_fd >= 0){
+		e->wd = inotify_add_watch(notify_fd, name, INOTIFY_MASK);
+		if (e->wd < 0){
+			fprintf(stderr,"error watching %s, errno %d (sizes under it may get stale)\n",name,errno);
+		}
+		else{
+			if (e->wd >= wd_cap){
+				i = wd_cap;
+				wd_cap = 2*(e->wd+1);
+				if ((tmp = realloc(by_wd, wd_cap * sizeof(watch_entry*))) == NULL){
+					fprintf(stderr,"error allocating watch descriptors\n");
+					inotify_rm_watch(notify_fd, e->wd);
+					e->wd = -1;
+					wd_cap = i;
+					return e;
+				}
+				by_wd = tmp;
+				memset(by_wd + i, 0, (wd_cap - i) * sizeof(watch_entry*));
+			}
+			by_wd[e->wd] = e;
+		}
+	}
+	return e;
+}
+
+/*
+ * Removes directory prefix and every directory under it from the watch table (a directory was deleted or moved away).
+ */
+void watch_remove(char* prefix){
+	unsigned long i, len = strlen(prefix);
+	watch_entry** link, *e;
+	for (i=0 ; i<table_cap ; i++){
+		link = table + i;
+		while ((e = *link) != NULL){
+			if (strncmp(e->name, prefix, len) == 0 && (e->name[len] == '\0' || e->name[len] == '/')){
+				*link = e->next;
+				if (e->wd >= 0){
+					by_wd[e->wd] = NULL;
+					inotify_rm_watch(notify_fd, e->wd); //fails harmlessly if kernel already dropped it
+				}
+				emit(sinks + num, REC_REMOVED, e->name, 0);
+				free(e->name);
+				free(e);
+				table_len--;
+				top_stale = 1;
+			}
+			else{
+				link = &e->next;
+			}
+		}
+	}
+}
+
+/*
+ * Sums sizes of files directly inside directory path, with the scan's modes and filters (see scan_level).
+ * If children is not NULL, full paths of sub directories are added to it.
+ * Returns 0 on success, 1 otherwise (errno is kept, so ENOENT tells the directory is gone).
+ */
+int level_size(char* path, unsigned long* size, dir_list* children){
+	return scan_level(ctx, path, size, children != NULL ? add_child : NULL, children);
 }
 
 /*
- * Adds a directory name to queue.
- * Receives a pointer to a string holding the name of wanted directory.
- * If queue was previously empty, will wake threads waiting on cond var.
+ * Child callback of level_size: adds a copy of path to the list.
  * Returns 0 on success, 1 otherwise.
- * Only cancellation points in this function are prints which are made when all resorces have already been freed
  */
-int enque(char* dir, char* name){
-	node* n = make_node(dir, name);
-	if (n==NULL){
+int add_child(void* list, const char* path){
+	char* copy = strdup(path);
+	return copy == NULL || dir_list_add(list, copy, 0);
+}
+
+/*
+ * Adds a directory that appeared after the scan (and everything under it) to the watch table.
+ * Entry (and its watch) is created before the directory is read, so changes made while reading it are not lost.
+ * Returns 0 on success (or if the directory is already gone), 1 otherwise.
+ */
+int watch_add_tree(char* path){
+	int i, ret = 0;
+	dir_list children = {NULL, 0, 0};
+	watch_entry* e;
+	char* name;
+	if (watch_find(path) != NULL){
+		return 0;
+	}
+	if ((name = strdup(path)) == NULL || (e = watch_insert(name, 0)) == NULL){
 		return 1;
 	}
-	if (pthread_mutex_lock(&q_mutex)){ //failed acquiring mutex in enqueue
-		destroy_node(n);
-		fprintf(stderr,"error in enqueue mutex acquire");
+	if (level_size(path, &e->size, &children)){
+		dir_list_free(&children);
+		if (errno == ENOENT){ //raced with removal, which has its own event
+			watch_remove(path);
+			return 0;
+		}
 		return 1;
 	}
-	if EMPTY{
-		q.head = n;
-		q.tail = n;
-		if (pthread_cond_signal(&empty)){
-			pthread_mutex_unlock(&q_mutex);//release taken lock
-			fprintf(stderr,"error in signaling");
+	emit(sinks + num, REC_DIR, e->name, e->size);
+	for (i=0 ; i<children.len && !ret ; i++){
+		ret = watch_add_tree(children.items[i].name);
+	}
+	dir_list_free(&children);
+	return ret;
+}
+
+/*
+ * Records a change reported by either backend: entry "name" inside watched directory "path" changed.
+ * Sub directories that appear are queued to be added, ones that disappear are removed now.
+ * Anything else just marks "path" dirty (once), to be rescanned by watch_flush.
+ */
+void watch_note(char* path, char* name, int isdir, int removed){
+	watch_entry* e;
+	char* full, *copy;
+	if (isdir && name != NULL){
+		if ((full = malloc(strlen(path) + strlen(name) + 2)) == NULL){
+			fprintf(stderr,"error allocating path for %s\n",name);
+			return;
+		}
+		sprintf(full, "%s/%s", path, name);
+		if (removed){
+			watch_remove(full);
+			free(full);
+		}
+		else if (watch_find(path) == NULL || scan_pruned(ctx, path, name)){
+			free(full); //under a pruned directory (if its parent is new, the parent's tree scan will find it) or pruned
+		}
+		else if (dir_list_add(&pending, full, PENDING_TREE)){
+			fprintf(stderr,"error queueing new directory\n");
+		}
+		return;
+	}
+	if ((e = watch_find(path)) == NULL || e->dirty){
+		return;
+	}
+	if ((copy = strdup(path)) == NULL || dir_list_add(&pending, copy, PENDING_LEVEL)){
+		fprintf(stderr,"error queueing rescan of %s\n",path);
+		return;
+	}
+	e->dirty = 1;
+}
+
+/*
+ * Rescans all pending directories: dirty ones at their own level, new ones with their whole tree.
+ * Changed sizes are printed like in the scan.
+ */
+void watch_flush(){
+	int i;
+	unsigned long size;
+	watch_entry* e;
+	for (i=0 ; i<pending.len ; i++){
+		if (pending.items[i].size == PENDING_TREE){
+			if (watch_add_tree(pending.items[i].name)){
+				fprintf(stderr,"error adding new directory %s, errno %d\n",pending.items[i].name,errno);
+			}
+			continue;
+		}
+		if ((e = watch_find(pending.items[i].name)) == NULL){ //removed since it was marked
+			continue;
+		}
+		e->dirty = 0;
+		if (level_size(e->name, &size, NULL)){
+			if (errno == ENOENT){
+				watch_remove(pending.items[i].name);
+			}
+			continue;
+		}
+		if (size != e->size){
+			e->size = size;
+			top_stale = 1;
+			emit(sinks + num, REC_DIR, e->name, e->size);
+		}
+	}
+	dir_list_free(&pending);
+}
+
+/*
+ * Marks every watched directory dirty, used when the kernel dropped events (queue overflow).
+ */
+void watch_all_dirty(){
+	unsigned long i;
+	watch_entry* e;
+	for (i=0 ; i<table_cap ; i++){
+		for (e = table[i] ; e != NULL ; e = e->next){
+			watch_note(e->name, NULL, 0, 0);
+		}
+	}
+}
+
+/*
+ * Opens the change notification backend for tree root, before it is scanned: events of the scan's time wait in the
+ * kernel's queue until watch_seed.
+ * fanotify can watch a whole filesystem with one mark, and reports the directory of each event as a file handle,
+ * but needs CAP_SYS_ADMIN (and a kernel reporting directory handles and names). If it is not available,
+ * fall back to inotify with a watch per directory, added by watch_scanned as the scan reaches it.
+ * Returns 0 on success, 1 otherwise.
+ */
+int watch_notify_init(char* root){
+	notify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK, O_RDONLY);
+	if (notify_fd >= 0 && (mount_fd = open(root, O_RDONLY | O_DIRECTORY)) >= 0 &&
+			fanotify_mark(notify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_CREATE | FAN_DELETE | FAN_MODIFY |
+					FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR, AT_FDCWD, root) == 0){
+		use_fanotify = 1;
+	}
+	else{
+		if (notify_fd >= 0){
+			close(notify_fd);
+		}
+		if (mount_fd >= 0){
+			close(mount_fd);
+			mount_fd = -1;
+		}
+		if ((notify_fd = inotify_init1(IN_NONBLOCK)) < 0){
+			fprintf(stderr,"error initializing inotify, errno %d\n",errno);
 			return 1;
 		}
 	}
+	fprintf(stderr,"watching %s using %s\n",root,use_fanotify ? "fanotify" : "inotify");
+	clock_gettime(CLOCK_REALTIME, &watch_start);
+	return 0;
+}
+
+/*
+ * Called by scan thread "thread" for each directory it scanned. With inotify, adds the directory's watch now rather
+ * than after the scan. The directory was read before its watch existed, so if it changed since the scan started
+ * (its ctime, a second earlier as timestamps come from a coarse clock) it is kept for watch_seed to reconcile.
+ * A file written in that short window leaves its directory's ctime as is and is only caught by a later event.
+ * The watch descriptor is not kept here: watch_insert adds the same watch again, which returns the same descriptor.
+ * Returns 0 on success, 1 on allocation failure.
+ */
+int watch_scanned(int thread, const char* path){
+	struct stat st;
+	char* copy;
+	if (use_fanotify || inotify_add_watch(notify_fd, path, INOTIFY_MASK) < 0){ //failure is reported by watch_insert
+		return 0;
+	}
+	if (stat(path, &st) == 0 && st.st_ctim.tv_sec < watch_start.tv_sec - 1){
+		return 0;
+	}
+	return (copy = strdup(path)) == NULL || dir_list_add(changed + thread, copy, 0);
+}
+
+/*
+ * Moves all scanned directories into the watch table, reconciles the ones that changed before their inotify watch
+ * existed, and then reads the events queued during the scan, so they become pending rescans.
+ * Returns 0 on success, 1 otherwise.
+ */
+int watch_seed(){
+	int i, j, ret = 0;
+	for (i=0 ; i<num ; i++){
+		for (j=0 ; j<scanned[i].len ; j++){
+			if (watch_insert(scanned[i].items[j].name, scanned[i].items[j].size) == NULL){
+				scanned[i].items[j].name = NULL; //already freed
+				fprintf(stderr,"error allocating watch table\n");
+				return 1;
+			}
+			scanned[i].items[j].name = NULL; //owned by table now
+		}
+		dir_list_free(scanned + i);
+	}
+	for (i=0 ; i<num ; i++){
+		for (j=0 ; j<changed[i].len ; j++){
+			if (watch_reconcile(changed[i].items[j].name)){
+				fprintf(stderr,"error reconciling %s, errno %d\n",changed[i].items[j].name,errno);
+				ret = 1;
+			}
+		}
+		dir_list_free(changed + i);
+	}
+	watch_notify_read();
+	return ret;
+}
+
+/*
+ * Rescans the level of watched directory path, and adds its sub directories that the scan did not see.
+ * Sub directories removed meanwhile are dropped when their own rescan finds them gone.
+ * Returns 0 on success (or if the directory is gone), 1 otherwise.
+ */
+int watch_reconcile(char* path){
+	int i, ret = 0;
+	dir_list children = {NULL, 0, 0};
+	unsigned long size;
+	watch_entry* e;
+	if ((e = watch_find(path)) == NULL){
+		return 0;
+	}
+	if (level_size(path, &size, &children)){
+		dir_list_free(&children);
+		if (errno == ENOENT){
+			watch_remove(path);
+			return 0;
+		}
+		return 1;
+	}
+	if (size != e->size){
+		e->size = size;
+		top_stale = 1;
+		emit(sinks + num, REC_DIR, e->name, e->size);
+	}
+	for (i=0 ; i<children.len && ret == 0 ; i++){
+		ret = watch_add_tree(children.items[i].name);
+	}
+	dir_list_free(&children);
+	return ret;
+}
+
+/*
+ * Reads all available events from notify_fd and passes them to watch_note.
+ */
+void watch_notify_read(){
+	char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX], link[64];
+	ssize_t len, plen;
+	struct inotify_event* ie;
+	struct fanotify_event_metadata* fe;
+	struct fanotify_event_info_fid* fid;
+	struct file_handle* fh;
+	char* p;
+	int fd;
+	while ((len = read(notify_fd, buf, sizeof(buf))) > 0){
+		if (!use_fanotify){
+			for (p = buf ; p < buf + len ; p += sizeof(struct inotify_event) + ie->len){
+				ie = (struct inotify_event*) p;
+				if (ie->mask & IN_Q_OVERFLOW){
+					watch_all_dirty();
+				}
+				else if (ie->wd >= 0 && ie->wd < wd_cap && by_wd[ie->wd] != NULL){
+					watch_note(by_wd[ie->wd]->name, ie->len ? ie->name : NULL, (ie->mask & IN_ISDIR) != 0,
+							(ie->mask & (IN_DELETE | IN_MOVED_FROM)) != 0);
+				}
+			}
+			continue;
+		}
+		for (fe = (struct fanotify_event_metadata*) buf ; FAN_EVENT_OK(fe, len) ; fe = FAN_EVENT_NEXT(fe, len)){
+			if (fe->mask & FAN_Q_OVERFLOW){
+				watch_all_dirty();
+				continue;
+			}
+			fid = (struct fanotify_event_info_fid*)(fe + 1);
+			if (fe->event_len <= sizeof(*fe) || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME){
+				continue;
+			}
+			fh = (struct file_handle*) fid->handle;
+			if ((fd = open_by_handle_at(mount_fd, fh, O_PATH)) < 0){ //directory is already gone
+				continue;
+			}
+			sprintf(link, "/proc/self/fd/%d", fd);
+			plen = readlink(link, path, sizeof(path) - 1);
+			close(fd);
+			if (plen <= 0){
+				continue;
+			}
+			path[plen] = '\0';
+			if (watch_find(path) != NULL){ //mark covers whole filesystem, ignore what is outside our tree
+				watch_note(path, (char*)(fh->f_handle + fh->handle_bytes), (fe->mask & FAN_ONDIR) != 0,
+						(fe->mask & (FAN_DELETE | FAN_MOVED_FROM)) != 0);
+			}
+		}
+	}
+}
+
+/*
+ * Returns K largest watched directories, sorted largest first.
+ * Computed with a heap of copies like the scan does, and cached until a size changes.
+ */
+dir_list* watch_top(){
+	unsigned long i;
+	watch_entry* e;
+	heap h;
+	char* copy;
+	if (!top_stale){
+		return &top_cache;
+	}
+	dir_list_free(&top_cache);
+	if ((h.items = malloc(k * sizeof(dir))) == NULL){
+		return &top_cache;
+	}
+	h.len = 0;
+	for (i=0 ; i<table_cap ; i++){
+		for (e = table[i] ; e != NULL ; e = e->next){
+			if ((h.len < k || e->size > h.items[0].size) && (copy = strdup(e->name)) != NULL){ //copy only candidates
+				keep_top(&h, copy, e->size);
+			}
+		}
+	}
+	qsort(h.items, h.len, sizeof(dir), cmp_dir);
+	top_cache.items = h.items; //heap array becomes the list
+	top_cache.len = h.len;
+	top_cache.cap = k;
+	top_stale = 0;
+	return &top_cache;
+}
+
+/*
+ * Answers one query on connection fd (see protocol at top). Connection is closed by caller.
+ */
+void watch_query(int fd){
+	char line[PATH_MAX + 16];
+	ssize_t len = 0, n;
+	int i;
+	watch_entry* e;
+	dir_list* top;
+	struct timeval timeout = {1, 0}; //a stuck client must not stall the daemon
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (len < (ssize_t)sizeof(line) - 1 && (n = read(fd, line + len, sizeof(line) - 1 - len)) > 0){
+		len += n;
+		if (memchr(line, '\n', len) != NULL){
+			break;
+		}
+	}
+	line[len] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+	if (strncmp(line, "SIZE ", 5) == 0){
+		if ((e = watch_find(line + 5)) == NULL){
+			dprintf(fd, "ERR no such directory\n");
+		}
+		else{
+			dprintf(fd, "%lu\n", e->size);
+		}
+	}
+	else if (strcmp(line, "TOP") == 0){
+		top = watch_top();
+		for (i=0 ; i<top->len ; i++){
+			dprintf(fd, "%lu %s\n", top->items[i].size, top->items[i].name);
+		}
+	}
 	else{
-		(q.tail)->next = n;
-		q.tail = n;
+		dprintf(fd, "ERR unknown command\n");
+	}
+}
+
+/*
+ * Daemon loop of watch mode. Serves queries and applies changes until SIGINT.
+ * Poll timeout is cut short when changes are pending, so they are flushed on time.
+ * Returns 0 on normal exit, 1 on error.
+ */
+int watch_run(char* sock_path){
+	struct sockaddr_un addr;
+	struct pollfd fds[3];
+	long now, first = 0, last = 0; //times of first and last event not flushed yet
+	int timeout, c, listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0){
+		fprintf(stderr,"error creating socket, errno %d\n",errno);
+		return 1;
 	}
-	if (pthread_mutex_unlock(&q_mutex)){
-		fprintf(stderr,"error in enqueue mute release");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+	unlink(sock_path); //left by a previous run
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 16)){
+		fprintf(stderr,"error binding socket %s, errno %d\n",sock_path,errno);
+		close(listen_fd);
 		return 1;
 	}
+	fds[0].fd = notify_fd;
+	fds[1].fd = listen_fd;
+	fds[2].fd = sig_fd;
+	fds[0].events = fds[1].events = fds[2].events = POLLIN;
+	while (!finished){ //raised by SIGINT, read from sig_fd
+		timeout = 1000;
+		now = now_ms();
+		if (pending.len > 0){
+			timeout = last + COALESCE_MS - now;
+			if (first + COALESCE_MAX_MS - now < timeout){
+				timeout = first + COALESCE_MAX_MS - now;
+			}
+			timeout = timeout < 0 ? 0 : timeout;
+		}
+		if (poll(fds, 3, timeout) < 0 && errno != EINTR){
+			fprintf(stderr,"error in poll, errno %d\n",errno);
+			break;
+		}
+		now = now_ms();
+		if (fds[2].revents & POLLIN && take_signal() == SIGINT){
+			break;
+		}
+		if (fds[0].revents & POLLIN){
+			if (pending.len == 0){
+				first = now;
+			}
+			watch_notify_read();
+			last = now;
+		}
+		if (fds[1].revents & POLLIN && (c = accept(listen_fd, NULL, NULL)) >= 0){
+			watch_query(c);
+			close(c);
+		}
+		if (pending.len > 0 && (now - last >= COALESCE_MS || now - first >= COALESCE_MAX_MS)){
+			watch_flush();
+		}
+		sink_flush(sinks + num); //daemon output should not lag behind changes
+
+	}
+	close(listen_fd);
+	unlink(sock_path);
 	return 0;
 }
 
 /*
- * Creates a list node containing directory name.
- * On success returns pointer to node, on failure returns NULL
- * Names are probably part of structs, so we will allocate new space for strings and copy them.
- * There are no cancellation points in this function, except prints in errors which result in termination any way
+ * Frees watch table and closes notification descriptors.
  */
-node* make_node(char* path, char* dir){
-	node* n = calloc(1,sizeof(node));
-	if (n==NULL){
-		fprintf(stderr,"error in allocating new node\n");
-		return NULL;
+void destroy_watch(){
+	unsigned long i;
+	watch_entry* e, *nxt;
+	for (i=0 ; i<table_cap ; i++){
+		for (e = table[i] ; e != NULL ; e = nxt){
+			nxt = e->next;
+			free(e->name);
+			free(e);
+		}
 	}
-	int len = strlen(path) + strlen(dir) + 1; //node will contain full path (directory + / + direc)
-	n->name = malloc((len+1)*sizeof(char)); //+1 to make room for null terminator as well
-	if (n->name == NULL){
-		free(n);
-		fprintf(stderr,"error in allocating new string - make node\n");
-		return NULL;
+	free(table);
+	free(by_wd);
+	table = NULL;
+	by_wd = NULL;
+	table_cap = table_len = 0;
+	dir_list_free(&pending);
+	dir_list_free(&top_cache);
+	if (scanned != NULL){
+		for (i=0 ; i<num ; i++){
+			dir_list_free(scanned + i);
+		}
+		free(scanned);
+		scanned = NULL;
+	}
+	if (changed != NULL){
+		for (i=0 ; i<num ; i++){
+			dir_list_free(changed + i);
+		}
+		free(changed);
+		changed = NULL;
+	}
+	if (notify_fd >= 0){
+		close(notify_fd);
+	}
+	if (mount_fd >= 0){
+		close(mount_fd);
+	}
+}
+
+/*
+ * Formats one record into sink s in the selected format, writing the sink out first if it has no room for it.
+ * Worst case record is bounded (json escapes a byte into at most 6), so checking room up front is enough.
+ */
+void emit(sink* s, int type, const char* name, unsigned long size){
+	static char* types[] = {"dir", "subtree", "removed"};
+	static char* text[] = {"files total size: ", "subtree total size: ", "removed"};
+	size_t len = strlen(name);
+	char* out;
+	const char* c;
+	bin_header h;
+	if (quiet){
+		return;
+	}
+	if (s->len + 6*len + 64 > SINK_SIZE){
+		sink_flush(s);
+	}
+	out = s->buf + s->len;
+	switch (format){
+	case FMT_TEXT:
+		if (type == REC_REMOVED){
+			out += sprintf(out, "%s, %s\n", name, text[type]);
+		}
+		else{
+			out += sprintf(out, "%s, %s%lu\n", name, text[type], size);
+		}
+		break;
+	case FMT_CSV:
+		out += sprintf(out, "%s,%lu,", types[type], size);
+		if (strpbrk(name, ",\"\n\r") == NULL){
+			memcpy(out, name, len);
+			out += len;
+		}
+		else{ //quote field, doubling quotes
+			*out++ = '"';
+			for (c = name ; *c ; c++){
+				if (*c == '"'){
+					*out++ = '"';
+				}
+				*out++ = *c;
+			}
+			*out++ = '"';
+		}
+		*out++ = '\n';
+		break;
+	case FMT_JSON:
+		out += sprintf(out, "{\"type\":\"%s\",\"size\":%lu,\"path\":\"", types[type], size);
+		for (c = name ; *c ; c++){
+			if (*c == '"' || *c == '\\'){
+				*out++ = '\\';
+				*out++ = *c;
+			}
+			else if ((unsigned char)*c < 0x20){
+				out += sprintf(out, "\\u%04x", (unsigned char)*c);
+			}
+			else{
+				*out++ = *c;
+			}
+		}
+		out += sprintf(out, "\"}\n");
+		break;
+	case FMT_BIN:
+		h.size = size;
+		h.path_len = len;
+		h.type = type;
+		memcpy(out, &h, sizeof(h));
+		memcpy(out + sizeof(h), name, len);
+		out += sizeof(h) + len;
+		break;
+	}
+	s->len = out - s->buf;
+}
+
+/*
+ * Writes whatever sink s holds to stdout. The lock keeps writes of different threads from interleaving
+ * (a write to a pipe larger than PIPE_BUF is not atomic). A worker sends it to the coordinator as a frame instead.
+ */
+void sink_flush(sink* s){
+	if (s == NULL || s->buf == NULL || s->len == 0){
+		return;
+	}
+	if (in_worker){
+		send_frame(out_fd, FRAME_RECS, s->buf, s->len);
+	}
+	else{
+		pthread_mutex_lock(&out_mutex);
+		write_all(out_fd, s->buf, s->len);
+		pthread_mutex_unlock(&out_mutex);
 	}
-	strncpy(n->name,path,strlen(path)); //copy path name
-	(n->name)[strlen(path)] = '/'; //add / seperator
-	strncpy((n->name + strlen(path) + 1),dir,strlen(dir)+1); //copy dir name + null terminator
-	return n;
+	s->len = 0;
 }
 
 /*
- * Frees all allocated data associated with this node.
- * note that any nodes pointed by this node will still be allocated.
+ * write() to fd until all of buf is written or an error occurs.
  */
-void destroy_node(node* n){
-	free(n->name);
-	free(n);
+void write_all(int fd, char* buf, size_t len){
+	ssize_t n;
+	while (len > 0){
+		if ((n = write(fd, buf, len)) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			fprintf(stderr,"error writing output, errno %d\n",errno);
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
 }
 
 /*
- * Frees all allocated data in queue.
- * Used when a sigint is recieved and we exit when queue is not empty
+ * Frees output buffers (their content should have been flushed).
  */
-void destroy_q(){
-	node* cur, *nxt;
-	cur = (q.head);
-	while (cur != NULL){
-		nxt = cur->next;
-		destroy_node(cur);
-		cur = nxt;
+void destroy_sinks(){
+	int i;
+	if (sinks == NULL){
+		return;
+	}
+	for (i=0 ; i<=num ; i++){
+		free(sinks[i].buf);
 	}
+	free(sinks);
+	sinks = NULL;
 }
 
 /*
- * Initializes all resources (locks, condvar etc) and data structures for process.
+ * Initializes the output buffers, heaps and lock of the program (the scan has its own, see scan_create).
  * Separated from main in order to improve readability.
  */
 int init(int num){
-	max.size = 0; //no need for atomicity as no concurancy at this point
-	max.name = NULL;
-	threads = (pthread_t*) calloc(num , sizeof(pthread_t));
-	if (threads == NULL){
-		fprintf(stderr,"error in allocating threads array\n");
-		return 1;
-	}
-	alive = (char*) calloc(num , sizeof(char));
-	if (alive == NULL){
-		free(threads);
-		fprintf(stderr,"error in allocating threads array\n");
-		return 1;
+	int i, j;
+	tops = (heap*) calloc(num , sizeof(heap)); //no need for atomicity as no concurancy at this point
+	for (i=0 ; tops!=NULL && i<num ; i++){
+		if ((tops[i].items = (dir*) malloc(k * sizeof(dir))) == NULL){
+			break;
+		}
 	}
-	if (pthread_mutex_init(&max_mutex, NULL)){ //init lock for max struct
-		free(alive);
-		free(threads);
-		fprintf(stderr,"Failure initializing max lock\n");
-		return 1;
+	largest_sub = (dir*) calloc(num , sizeof(dir));
+	scanned = (dir_list*) calloc(num , sizeof(dir_list));
+	changed = (dir_list*) calloc(num , sizeof(dir_list));
+	sinks = (sink*) calloc(num+1 , sizeof(sink)); //+1 for main
+	for (j=0 ; sinks!=NULL && j<=num ; j++){
+		if ((sinks[j].buf = malloc(SINK_SIZE)) == NULL){
+			break;
+		}
 	}
-	if (pthread_mutex_init(&q_mutex, NULL)){
-		free(alive);
-		free(threads);
-		pthread_mutex_destroy(&max_mutex);
-		fprintf(stderr,"Failure initializing q lock\n");
+	if (tops == NULL || i<num || largest_sub == NULL || scanned == NULL || changed == NULL || sinks == NULL || j<=num){
+		destroy_tops();
+		destroy_watch();
+		destroy_sinks();
+		fprintf(stderr,"error in allocating top heaps\n");
 		return 1;
 	}
-	if (pthread_cond_init (&empty, NULL)){
-		free(alive);
-		free(threads);
-		pthread_mutex_destroy(&max_mutex);
-		pthread_mutex_destroy(&q_mutex);
-		fprintf(stderr,"Failure conditional variable\n");
+	if (pthread_mutex_init(&out_mutex, NULL)){
+		destroy_tops();
+		destroy_watch();
+		destroy_sinks();
+		fprintf(stderr,"Failure initializing output lock\n");
 		return 1;
 	}
 	return 0;
 }
 
 /*
- *	Assigns new signal handler for SIGINT.
+ *	Blocks SIGINT and SIGUSR1 (inherited by all threads and by workers) and opens sig_fd to read them instead.
  *	Separated from main in order to improve readability.
  */
 int register_sig(){
-	//Assign new handler for sigint
-	struct sigaction new_action;
-	memset(&new_action, 0, sizeof(new_action));
-	new_action.sa_sigaction = sig_handler;
-	new_action.sa_flags = SA_SIGINFO;
-	if (sigaction(SIGINT, &new_action, NULL)){
-		fprintf(stderr,"Failure assigning sig handler\n");
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL)){
+		fprintf(stderr,"Failure blocking signals\n");
+		return 1;
+	}
+	if ((sig_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0){
+		fprintf(stderr,"Failure creating signalfd, errno %d\n",errno);
 		return 1;
 	}
 	return 0;
 }
 
+/*
+ * Reads one pending signal from sig_fd and acts on SIGINT (SIGUSR1 is left to the caller).
+ * Returns the signal number, or 0 if none was pending.
+ */
+int take_signal(){
+	struct signalfd_siginfo info;
+	if (read(sig_fd, &info, sizeof(info)) != sizeof(info)){
+		return 0;
+	}
+	if (info.ssi_signo == SIGINT){
+		stop_scan();
+	}
+	return info.ssi_signo;
+}
+
 /*
  * Releases all resources allocated by main function.
  * Separated from main for modularity and to decrease code blow up
  */
 void destroy(){
-    free(threads);
-    free(alive);
-	pthread_mutex_destroy(&q_mutex);
-	pthread_mutex_destroy(&max_mutex);
-	pthread_cond_destroy(&empty);
-	destroy_q();
-	if (max.name!=NULL){
-		free(max.name);
+	if (sig_fd >= 0){
+		close(sig_fd);
+	}
+	scan_destroy(ctx);
+	ctx = NULL;
+	destroy_tops();
+	destroy_watch();
+	if (sinks != NULL){
+		sink_flush(sinks + num);
 	}
+	destroy_sinks();
+	dir_list_free(&patterns);
+	pthread_mutex_destroy(&out_mutex);
 }
 
 /*
- * Custom sig handler for SIGINT
- * Sends cancellation orders to all live threads, and updates a flag indicating that the search has stopped (used by main
- * for output serving).
+ * Frees all heaps and the directory names they still own.
  */
-void sig_handler(int signum, siginfo_t *info, void *ptr){
-	if (finished){ //so sigint won't be caught more than once
+void destroy_tops(){
+	int i, j;
+	if (tops == NULL){
 		return;
 	}
-	printf("\n\n\n\n SIGINT caught %ld. Wrapping it up.\n \n\n\n\n",pthread_self());
-	__sync_fetch_and_add(&finished, 1); //threads will know to wrap it up
-	for (long i=0; i<num ; i++){
-		if (alive[i]!=0){
-			pthread_cancel(threads[i]); //probably will return 3, as cancellation is delayed
+	for (i=0 ; i<num ; i++){
+		for (j=0 ; j<tops[i].len ; j++){
+			free(tops[i].items[j].name);
+		}
+		free(tops[i].items); //free(NULL) is fine for heaps that failed allocation
+		if (largest_sub != NULL){
+			free(largest_sub[i].name);
 		}
 	}
-	return;
+	free(tops);
+	free(largest_sub);
+	tops = NULL;
+	largest_sub = NULL;
 }
 
 /*
- * Cleanup function pushed to release lock when a thread gets canceled waiting on condition.
+ * Handles SIGINT (in a normal thread, read from sig_fd): stops the scan, and updates a flag indicating that the search
+ * has stopped (used by main for output serving).
  */
-void clean_lock(void* lock){
-	pthread_mutex_unlock(lock);
-	//printf("cleaned lock by thread %ld\n",pthread_self());
+void stop_scan(){
+	if (finished){ //so sigint won't be handled more than once
+		return;
+	}
+	//not on stdout, which may carry csv/json/bin records (or, in a worker, the coordinator's output)
+	fputs("\n SIGINT caught. Wrapping it up.\n\n", in_worker ? stderr : report);
+	finished = 1; //main loops will know to wrap it up
+	if (ctx != NULL){
+		scan_cancel(ctx); //threads finish the directory they are on and leave
+	}
 }
 
@@ -0,0 +1,161 @@
+/*
+ * make_tree.c
+ *
+ * Creates a synthetic directory tree to benchmark distributed_subdir_size on.
+ * This program receives two command line arguments:
+ * 		Dir - Name of a directory to create the tree in (created if missing).
+ * 		Shape - wide (few levels, many directories in each), deep (F chains of D directories) or mix.
+ * And optional flags:
+ * 		-F F - Fanout: number of sub-directories in each directory (default: wide 32, deep 16, mix 6).
+ * 		-D D - Depth: number of directory levels below Dir (default: wide 2, deep 64, mix 4).
+ * 		-n N - Number of files in each directory (default 10).
+ * 		-b B - Maximal file size in bytes, each file gets a random size up to B (default 4096).
+ * 		-S S - Seed for the random sizes, so a tree can be recreated exactly (default 1).
+ *
+ * In mix shape the fanout of each directory is random between 1 and 2*F-1, so some branches are much heavier than others.
+ * Files are created with ftruncate, so they are sparse and creating a big tree costs inodes, not disk space.
+ *
+ * On success prints the number of directories, files and bytes created.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+
+#define SHAPE_WIDE 0
+#define SHAPE_DEEP 1
+#define SHAPE_MIX 2
+
+int make_dir(char* path, int level);
+
+int shape, fanout = -1, depth = -1, files = 10;
+long max_size = 4096;
+unsigned int seed = 1;
+unsigned long dirs_made = 0, files_made = 0, bytes_made = 0;
+
+int main(int argc, char** argv){
+	int opt;
+	char path[PATH_MAX];
+	int defaults[3][2] = {{32, 2}, {16, 64}, {6, 4}}; //fanout and depth of each shape
+	while ((opt = getopt(argc, argv, "F:D:n:b:S:")) != -1){
+		if (opt == 'F' && atoi(optarg) > 0){
+			fanout = atoi(optarg);
+		}
+		else if (opt == 'D' && atoi(optarg) >= 0){
+			depth = atoi(optarg);
+		}
+		else if (opt == 'n' && atoi(optarg) >= 0){
+			files = atoi(optarg);
+		}
+		else if (opt == 'b' && atol(optarg) >= 0){
+			max_size = atol(optarg);
+		}
+		else if (opt == 'S'){
+			seed = strtoul(optarg, NULL, 10);
+		}
+		else{
+			fprintf(stderr,"Usage: %s [-F fanout] [-D depth] [-n files] [-b max_size] [-S seed] <dir> <wide|deep|mix>\n",argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind != 2){
+		fprintf(stderr,"Usage: %s [-F fanout] [-D depth] [-n files] [-b max_size] [-S seed] <dir> <wide|deep|mix>\n",argv[0]);
+		exit(1);
+	}
+	if (!strcmp(argv[optind+1], "wide")){
+		shape = SHAPE_WIDE;
+	}
+	else if (!strcmp(argv[optind+1], "deep")){
+		shape = SHAPE_DEEP;
+	}
+	else if (!strcmp(argv[optind+1], "mix")){
+		shape = SHAPE_MIX;
+	}
+	else{
+		fprintf(stderr,"unknown shape %s, should be wide, deep or mix\n",argv[optind+1]);
+		exit(1);
+	}
+	if (fanout < 0){
+		fanout = defaults[shape][0];
+	}
+	if (depth < 0){
+		depth = defaults[shape][1];
+	}
+	srand(seed);
+	if (mkdir(argv[optind], 0755) && errno != EEXIST){
+		fprintf(stderr,"error creating %s: %s\n",argv[optind],strerror(errno));
+		exit(1);
+	}
+	strncpy(path, argv[optind], PATH_MAX - 1);
+	path[PATH_MAX - 1] = '\0';
+	if (make_dir(path, 0)){
+		exit(1);
+	}
+	printf("Created %lu dirs, %lu files, %lu bytes\n",dirs_made,files_made,bytes_made);
+	return 0;
+}
+
+/*
+ * Fills the (existing) directory path with files and, unless it is at the last level, sub-directories.
+ * path is a buffer of PATH_MAX that is extended in place for children and restored before returning.
+ * Returns 0 on success, 1 on failure.
+ */
+int make_dir(char* path, int level){
+	int i, fd, sub;
+	long size;
+	size_t len = strlen(path);
+	dirs_made++;
+	for (i=0 ; i<files ; i++){
+		if (snprintf(path + len, PATH_MAX - len, "/f%d", i) >= (int)(PATH_MAX - len)){
+			fprintf(stderr,"path too long under %.*s\n",(int)len,path);
+			return 1;
+		}
+		size = max_size ? rand() % (max_size + 1) : 0;
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+			fprintf(stderr,"error creating %s: %s\n",path,strerror(errno));
+			return 1;
+		}
+		if (ftruncate(fd, size)){
+			fprintf(stderr,"error sizing %s: %s\n",path,strerror(errno));
+			close(fd);
+			return 1;
+		}
+		close(fd);
+		files_made++;
+		bytes_made += size;
+	}
+	path[len] = '\0';
+	if (level == depth){
+		return 0;
+	}
+	sub = fanout;
+	if (shape == SHAPE_MIX){
+		sub = 1 + rand() % (2 * fanout - 1);
+	}
+	else if (shape == SHAPE_DEEP && level > 0){
+		sub = 1; //deep trees are a few long chains, branching only at the root
+	}
+	for (i=0 ; i<sub ; i++){
+		if (snprintf(path + len, PATH_MAX - len, "/d%d", i) >= (int)(PATH_MAX - len)){
+			fprintf(stderr,"path too long under %.*s\n",(int)len,path);
+			return 1;
+		}
+		if (mkdir(path, 0755) && errno != EEXIST){
+			fprintf(stderr,"error creating %s: %s\n",path,strerror(errno));
+			return 1;
+		}
+		if (make_dir(path, level + 1)){
+			return 1;
+		}
+		path[len] = '\0';
+	}
+	return 0;
+}
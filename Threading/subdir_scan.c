@@ -0,0 +1,2027 @@
+/*
+ * subdir_scan.c
+ *
+ * Threaded directory scanner, see subdir_scan.h for how to use it.
+ *
+ * For each directory in root's subtree, the scanner sums the file sizes that lay *directly* inside a directory
+ * (meaning: files contained in a sub-directory are not counted in their forefathers size).
+ *
+ * Search is organized using a linked queue: each thread dequeues a directory name and starts to sum it's files's sizes.
+ * As multiple threads are working simultaneously, concurrency issues are dealt with using conditional variables and
+ * mutex locks (only one thread can edit queue at each point).
+ *
+ * To avoid resource waste, if queue is empty threads waiting to dequeue wait on conditional variable "empty" until
+ * a new item is queued.
+ *
+ * The context uses two counters for number of live threads and number of idle threads.
+ * When a thread encounters an empty queue and all other threads are idle, this means the work is done.
+ * The last remaining threads falgs search is over and wakes all waiting threads.
+ *
+ * Inclusive sizes are aggregated bottom up in the same pass: every queued directory points to a small "subtree"
+ * record of the directory that contains it. A subtree keeps an atomic count of pending work (its own scan + one for each
+ * child directory that was queued). Whoever brings the count to zero owns the finished subtree: it reports it, adds its
+ * total to the parent and decrements the parent's count, possibly finishing the parent as well.
+ *
+ * The scan index is a flat file: a header followed by fixed size records sorted by (device, inode), each holding
+ * a directory's mtime, ctime, size and number of files. The previous index is mapped read only and searched with
+ * bsearch. A directory whose mtime and ctime did not change since is not statted file by file, its cached size is
+ * used (it is still read, to queue its sub directories which are checked on their own).
+ * Note that changing a file's content in place does not change its directory's times, so this will not be noticed.
+ * Each thread logs the records of directories it scanned privately. scan_index_save writes them to a new file
+ * (through a shared mapping), sorted, and renames it over the old one.
+ *
+ * Disk usage mode sums st_blocks*512 instead of st_size, so sparse files count what they really take, and
+ * a directory's own blocks are added to it. Files with more than one link are counted only by the first directory to
+ * see them: their (device, inode) goes into a set split into shards, each with its own lock, so threads rarely meet
+ * (and files with a single link, the vast majority, never touch it).
+ * With an index, a reused directory keeps the size it had, including its choice of which links it counted.
+ *
+ * Every thread counts what it did in its own counters struct, aligned to a cache line so that counting never
+ * makes threads share one. They are summed by scan_get_stats, without locks (a close estimate while scanning).
+ *
+ * Pruning filters (exclude and include patterns, max depth) are decided on the name of a sub directory before it is
+ * queued, so a pruned tree is never opened. Depth is the number of '/' in a path beyond root's, so no per node state
+ * is needed. Mount points (one_fs) can't be told from a dirent: a queued directory's fstat on its open descriptor
+ * (no path lookup) gives its device, and it is dropped before reading it if that differs from root's.
+ * Entries of filesystems that don't fill d_type (DT_UNKNOWN) are statted once to learn their type, and a regular
+ * file's stat is then reused for its size.
+ *
+ * Aggregation is done in the same pass, on the stat every file gets anyway. Each thread adds files to its own
+ * open addressing hash table of extensions and its own array of size buckets (bucket b holds sizes in
+ * [2^(b-1), 2^b), bucket 0 empty files), so the per file path takes no lock. They are merged when reported.
+ *
+ * Inode order (for cold caches on rotational disks, or large volumes) makes the metadata reads go mostly forward on
+ * disk instead of seeking back and forth. A directory is read whole into its thread's buffer and its entries are
+ * statted (and its sub directories queued) by ascending inode number rather than in readdir order, which on ext4
+ * and XFS is hash order and unrelated to where the inodes are. The queue becomes an elevator: two binary heaps
+ * by inode number, one holding directories at or past the inode of the last one taken (this sweep) and one holding
+ * those behind it (next sweep). Directories are taken from this sweep in ascending order, and when it runs out the
+ * heaps swap and the sweep starts over from the lowest inode. Removing the last items of a heap keeps it a heap,
+ * so giving work away takes them from there (next sweep first), which are the directories farthest ahead.
+ *
+ * Auto thread count (auto_threads) creates all threads, but lets only "limit" of them scan. A thread that finds more
+ * unparked threads than the limit when it comes to dequeue parks on its own condvar, counted as idle so that the end of
+ * the scan is detected as before. A controller thread samples the counters every TUNE_MS and hill climbs: starting at
+ * two threads, it grows the limit (by a quarter) while directories wait in the queue and no unparked thread is idle,
+ * beyond the number of CPUs only if the time per metadata operation is well above the best seen (threads are waiting
+ * for storage, not for CPU). It shrinks the limit by one while more than half of the unparked threads are idle. A move
+ * that did not pay (throughput, in entries read per second, not up by 5% after growing or down by more than 5% after
+ * shrinking) is undone and the limit is held for a while, so it settles where adding threads stops helping.
+ * Each change is logged with its time for scan_tune_report.
+ *
+ * Stopping (scan_cancel) is cooperative: it raises the finished flag and wakes every waiting thread, all under
+ * q_mutex. Threads check the flag each time they come to the queue, so a thread finishes the directory it is on
+ * (closing it and reporting it) and then leaves, and nothing is torn down halfway. Directories still queued stay
+ * in the queue: scan_save_state writes them, with root, to a state file, and scan_resume queues them again in a new
+ * context to continue the scan where it stopped. Subtrees of unfinished directories (inclusive) are released, not
+ * reported, when the queue is freed.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include "subdir_scan.h"
+
+#define EMPTY(c) ((c)->q.len == 0) //macro to check state of queue
+#define ALL_IDLE(c) ((c)->idle >= ((c)->total-1)) //macro to check if all threads are idle
+#define LAST(c) ((c)->idle == ((c)->total-1)) //macro to check if all threads but this one are idle
+#define INDEX_MAGIC 0x31585344 //"DSX1" in little endian, identifies an index file and its layout version
+#define SHARDS 64 //number of independently locked parts of the inode set
+#define BUCKETS 65 //log2 size buckets, 0 for empty files and one per bit of a 64 bit size
+#define TUNE_MS 100 //auto thread count: sampling period of the controller
+#define TUNE_HOLD 10 //samples to keep the limit after undoing a move
+#define STATE_MAGIC "subdir_scan state 1\n" //first line of a state file, identifies it and its layout version
+#define CHECK_THREAD(invoker, err_msg) CHECK_THREAD_DIR(invoker, err_msg, NULL)
+#define CHECK_THREAD_DIR(invoker, err_msg, dir) { \
+  if (invoker) { \
+	fprintf err_msg; \
+	thread_fail(c, serial, name, dir, self); \
+  } \
+} //macro to reduce redundant lines in thread_do and get_size, dir is the open directory (NULL if none).
+
+typedef struct t{
+	char* name; //full path of directory, kept until the whole subtree is done
+	unsigned long total; //inclusive size, children add to it as they finish
+	int pending; //own scan + number of child subtrees not finished yet
+	struct t* parent;
+}subtree;
+
+typedef struct n{
+	char* name;
+	subtree* parent; //subtree of containing directory, only used with inclusive
+	ino_t ino; //inode number from the parent's dirent (0 for root), only used with inode_order
+	struct n* next;
+}node;
+
+typedef struct q{
+	node* head;
+	node* tail;
+	node** heap[2]; //with inode_order, min heaps by inode: heap[cur] is this sweep, heap[!cur] the next one
+	int heap_len[2];
+	int heap_cap[2];
+	int cur;
+	ino_t cursor; //inode of the last directory taken, where this sweep is
+	int len; //number of queued directories, read without the lock by scan_queue_state
+}queue;
+
+typedef struct se{
+	ino_t ino;
+	size_t name; //offset of the name in the list's names
+	unsigned char type; //d_type
+}sorted_entry;
+
+typedef struct el{
+	sorted_entry* items; //entries of the directory being scanned, sorted by inode
+	int len;
+	int cap;
+	char* names; //null terminated names of all entries, back to back
+	size_t names_len;
+	size_t names_cap;
+}entry_list;
+
+//index file layout, fixed width types as the file outlives the process
+typedef struct ih{
+	uint32_t magic;
+	uint32_t count; //number of records following the header
+	uint32_t disk_usage; //sizes are allocated bytes, an index of the other kind is not used
+	uint32_t pad;
+}index_header;
+
+typedef struct ir{
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec, mtime_nsec;
+	int64_t ctime_sec, ctime_nsec;
+	uint64_t size; //files total size of directory
+	uint64_t files; //number of files in directory (used to estimate time saved on reuse)
+}index_rec;
+
+typedef struct il{
+	index_rec* recs; //records of directories scanned by this thread, for the next index
+	int len;
+	int cap;
+	unsigned long hits; //directories whose size was reused
+	unsigned long misses; //directories that had to be statted
+	unsigned long hit_files; //stats saved by reuse
+	unsigned long miss_files; //stats actually done on misses
+	unsigned long miss_ns; //time spent statting on misses
+}index_log;
+
+typedef struct is{
+	pthread_mutex_t lock;
+	uint64_t* keys; //pairs of (device, inode) by open addressing, inode 0 marks an empty slot
+	unsigned long cap; //number of slots, power of 2
+	unsigned long len;
+	unsigned long dups; //links found after the first one
+}__attribute__ ((aligned(64))) inode_shard; //own cache line each, so shards don't falsely share
+
+typedef struct ct{
+	unsigned long dirs;
+	unsigned long files;
+	unsigned long bytes;
+	unsigned long lock_wait_ns; //time spent acquiring q_mutex
+	unsigned long empty_wait_ns; //time spent waiting on empty for a directory to be queued
+	unsigned long pruned_match; //sub directories left out by exclude patterns
+	unsigned long pruned_depth; //sub directories left out by max_depth
+	unsigned long pruned_mount; //directories on another filesystem
+	unsigned long ops; //metadata operations: directories opened and entries read
+	unsigned long op_ns; //time spent on them (reading directories and statting their entries)
+}__attribute__ ((aligned(64))) counters;
+
+typedef struct ee{
+	char* ext; //NULL in an empty slot, "" for files without an extension
+	unsigned long files;
+	unsigned long bytes;
+}ext_entry;
+
+typedef struct ag{
+	ext_entry* exts; //open addressing hash table by extension, grows when half full
+	unsigned long cap; //power of 2
+	unsigned long len;
+	unsigned long bucket_files[BUCKETS];
+	unsigned long bucket_bytes[BUCKETS];
+}__attribute__ ((aligned(64))) aggregate;
+
+typedef struct pl{
+	char** globs;
+	char* full; //full[i] is set if globs[i] has a '/', it is matched against the full path
+	int len;
+	int cap;
+}pattern_list;
+
+typedef struct te{
+	double seconds; //since the run started
+	int limit;
+}tune_event;
+
+typedef struct ta{
+	scan_ctx* c;
+	long serial; //index of the thread in c
+}thread_arg;
+
+struct scan_ctx{
+	scan_options opt;
+	int num; //number of threads
+	pthread_t* threads; //will hold array of threads
+	char* alive; //alive[i] will keep a boolean attribute whether thread i is still alive
+	thread_arg* args; //args[i] is passed to thread i
+	int idle; //will count the number of idle threads
+	int total; //will count the total number of active threads (created and did not die)
+	int finished; //raised by scan_cancel, threads leave when they see it
+	queue q;
+	pthread_mutex_t q_mutex; //access control for queue
+	pthread_cond_t empty; //wait if queue is empty
+	int limit; //number of threads allowed to scan, the others park (all of them unless auto_threads)
+	int parked; //number of threads waiting on park, they are counted in idle as well
+	pthread_cond_t park; //threads over the limit wait here
+	pthread_cond_t tick; //controller waits here between samples (monotonic clock), signaled to stop it
+	int tuning; //cleared, under q_mutex, to stop the controller
+	tune_event* tune_log; //limit changes of the last run
+	int tune_len;
+	int tune_cap;
+	counters* stats; //stats[i] are counters of thread i
+	aggregate* aggs; //aggs[i] is thread i's aggregation by extension and size, NULL unless aggregating
+	inode_shard* inodes; //set of files with several links already counted, NULL unless disk usage
+	index_header* old_index; //mapping of previous index, read only and shared by all threads
+	size_t old_index_len; //length of mapping
+	index_log* logs; //logs[i] holds index records and statistics of thread i, NULL unless indexing
+	entry_list* lists; //lists[i] is thread i's buffer for reading a directory whole, NULL unless inode_order
+	pattern_list excludes;
+	pattern_list includes;
+	int root_set; //flag whether root, root_slashes and root_dev were set
+	char* root; //path of root directory, saved with the state
+	int root_slashes; //number of '/' in root's name, depth of a directory is its own count minus this
+	dev_t root_dev; //device of root directory, with one_fs
+	unsigned long root_total; //inclusive size of the whole tree, set by whoever finishes root
+};
+
+static void* thread_do(void* arg);
+static char* dequeue(scan_ctx* c, counters* st, int* done, subtree** parent);
+static int enque(scan_ctx* c, const char* dir, const char* name, ino_t ino, subtree* parent, counters* st);
+static int q_lock(scan_ctx* c, counters* st);
+static void* tune_do(void* arg);
+static void tune_note(scan_ctx* c, struct timespec* start);
+static int q_put(queue* q, node* n, int inode_order);
+static node* q_take(queue* q, int inode_order);
+static node* make_node(const char* path, const char* dir);
+static void destroy_node(node* n);
+static void destroy_q(scan_ctx* c);
+static int subtree_done(scan_ctx* c, subtree* s, long serial);
+static void thread_fail(scan_ctx* c, long serial, char* name, DIR* cur, subtree* self);
+static void subtree_drop(subtree* s);
+static int run(scan_ctx* c);
+static unsigned long get_size(scan_ctx* c, char* name, long serial, subtree* self, int* pruned);
+static int next_entry(DIR* cur, entry_list* l, int* pos, char** name, unsigned char* type, ino_t* ino);
+static int read_sorted(DIR* cur, entry_list* l);
+static int cmp_entry(const void* a, const void* b);
+static int entry_type(DIR* cur, const char* name, unsigned char d_type, struct stat* info, int* statted);
+static int prune_dir(scan_ctx* c, const char* parent, const char* name, int depth);
+static int pattern_add(pattern_list* l, const char* glob);
+static int pattern_match(pattern_list* l, const char* parent, const char* name, char* path);
+static void pattern_free(pattern_list* l);
+static int dir_depth(scan_ctx* c, const char* name);
+static void agg_file(aggregate* a, char* name, unsigned long bytes);
+static int agg_add(aggregate* a, char* ext, unsigned long files, unsigned long bytes);
+static void agg_free(aggregate* a);
+static int cmp_ext(const void* a, const void* b);
+static unsigned long file_bytes(scan_ctx* c, struct stat* info);
+static int inode_seen(scan_ctx* c, struct stat* info);
+static uint64_t inode_hash(uint64_t dev, uint64_t ino);
+static int index_load(scan_ctx* c, const char* path);
+static index_rec* index_find(scan_ctx* c, struct stat* info);
+static int index_log_add(index_log* log, struct stat* info, unsigned long size, unsigned long files);
+static int cmp_rec(const void* a, const void* b);
+static unsigned long hash_name(const char* name);
+static long ns_since(struct timespec* start);
+
+/*
+ * Fills o with the defaults: one thread, no limits, no modes, no callback.
+ */
+void scan_options_init(scan_options* o){
+	memset(o, 0, sizeof(*o));
+	o->threads = 1;
+	o->max_depth = -1;
+}
+
+/*
+ * Creates a context scanning with options o (copied, but index_path is kept as is and must outlive the context).
+ * Loads the previous index if there is one.
+ * Returns the context, or NULL on failure (reported on stderr).
+ */
+scan_ctx* scan_create(const scan_options* o){
+	int i;
+	scan_ctx* c;
+	pthread_condattr_t attr;
+	if (o->threads < 1){
+		fprintf(stderr,"number of threads should be positive\n");
+		return NULL;
+	}
+	if ((c = calloc(1, sizeof(scan_ctx))) == NULL){
+		fprintf(stderr,"error allocating scan context\n");
+		return NULL;
+	}
+	c->opt = *o;
+	c->num = o->threads;
+	if (pthread_mutex_init(&c->q_mutex, NULL)){
+		free(c);
+		fprintf(stderr,"Failure initializing q lock\n");
+		return NULL;
+	}
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (pthread_cond_init(&c->empty, NULL) || pthread_cond_init(&c->park, NULL) || pthread_cond_init(&c->tick, &attr)){
+		pthread_mutex_destroy(&c->q_mutex);
+		free(c);
+		fprintf(stderr,"Failure conditional variable\n");
+		return NULL;
+	}
+	pthread_condattr_destroy(&attr);
+	c->threads = (pthread_t*) calloc(c->num, sizeof(pthread_t));
+	c->alive = (char*) calloc(c->num, sizeof(char));
+	c->args = (thread_arg*) calloc(c->num, sizeof(thread_arg));
+	c->stats = (counters*) aligned_alloc(64, c->num * sizeof(counters)); //size is a multiple of 64 as the struct is aligned
+	if (c->stats != NULL){
+		memset(c->stats, 0, c->num * sizeof(counters));
+	}
+	if (o->aggregate && (c->aggs = (aggregate*) aligned_alloc(64, c->num * sizeof(aggregate))) != NULL){
+		memset(c->aggs, 0, c->num * sizeof(aggregate));
+	}
+	if (o->disk_usage && (c->inodes = (inode_shard*) aligned_alloc(64, SHARDS * sizeof(inode_shard))) != NULL){
+		memset(c->inodes, 0, SHARDS * sizeof(inode_shard));
+		for (i=0 ; i<SHARDS ; i++){
+			pthread_mutex_init(&c->inodes[i].lock, NULL); //can't fail for default attributes on linux
+		}
+	}
+	if (o->index_path != NULL){
+		c->logs = (index_log*) calloc(c->num, sizeof(index_log));
+	}
+	if (o->inode_order){
+		c->lists = (entry_list*) calloc(c->num, sizeof(entry_list));
+	}
+	if (c->threads == NULL || c->alive == NULL || c->args == NULL || c->stats == NULL || (o->aggregate && c->aggs == NULL) ||
+			(o->disk_usage && c->inodes == NULL) || (o->index_path != NULL && c->logs == NULL) || (o->inode_order && c->lists == NULL)){
+		fprintf(stderr,"error allocating scan context\n");
+		scan_destroy(c);
+		return NULL;
+	}
+	for (i=0 ; i<c->num ; i++){
+		c->args[i].c = c;
+		c->args[i].serial = i;
+	}
+	if (o->index_path != NULL && index_load(c, o->index_path)){
+		scan_destroy(c);
+		return NULL;
+	}
+	return c;
+}
+
+/*
+ * Adds an exclude pattern: sub directories matching glob pattern are not scanned (a pattern with a '/' is matched
+ * against the full path, otherwise against the name). Returns 0 on success, 1 on allocation failure.
+ */
+int scan_exclude(scan_ctx* c, const char* pattern){
+	return pattern_add(&c->excludes, pattern);
+}
+
+/*
+ * Adds an include pattern: sub directories matching it are scanned even if they match an exclude pattern.
+ * Returns 0 on success, 1 on allocation failure.
+ */
+int scan_include(scan_ctx* c, const char* pattern){
+	return pattern_add(&c->includes, pattern);
+}
+
+/*
+ * Sets the root of the tree: depth is counted from it, and with one_fs its filesystem is the one scanned.
+ * Only needed when scan_run is given parts of a tree (otherwise the first scan_run's path is the root).
+ * Returns 0 on success, 1 otherwise.
+ */
+int scan_set_root(scan_ctx* c, const char* root){
+	struct stat info;
+	const char* p;
+	char* copy = strdup(root);
+	if (copy == NULL){
+		fprintf(stderr,"error allocating root name\n");
+		return 1;
+	}
+	free(c->root);
+	c->root = copy;
+	if (c->opt.one_fs){
+		if (stat(root, &info)){
+			fprintf(stderr,"error getting stat info on directory %s, errno %d\n",root,errno);
+			return 1;
+		}
+		c->root_dev = info.st_dev;
+	}
+	c->root_slashes = 0;
+	for (p = root ; *p ; p++){
+		c->root_slashes += *p == '/';
+	}
+	c->root_set = 1;
+	return 0;
+}
+
+/*
+ * Scans the tree under path: queues it, creates the threads and joins them back.
+ * Can be called again after it returned.
+ * Returns 0 on success, 1 if some thread failed, 2 if all of them did.
+ */
+int scan_run(scan_ctx* c, const char* path){
+	if (!c->root_set && scan_set_root(c, path)){
+		return 2;
+	}
+	if (enque(c, path, NULL, 0, NULL, NULL)){
+		return 2;
+	}
+	return run(c);
+}
+
+/*
+ * Continues a stopped scan from the state file at path (see scan_save_state): sets its root (which must be the
+ * context's root, if one was set), queues the directories it lists and scans them like scan_run.
+ * Returns like scan_run, or 2 if the state can't be loaded.
+ */
+int scan_resume(scan_ctx* c, const char* path){
+	FILE* f = fopen(path, "r");
+	char* buf = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int ret = 0;
+	if (f == NULL){
+		fprintf(stderr,"error opening state %s, errno %d\n",path,errno);
+		return 2;
+	}
+	if (getline(&buf, &cap, f) < 0 || strcmp(buf, STATE_MAGIC) || getdelim(&buf, &cap, '\0', f) < 0){
+		fprintf(stderr,"%s is not a valid state file\n",path);
+		ret = 2;
+	}
+	else if (c->root_set && strcmp(buf, c->root)){
+		fprintf(stderr,"state %s was saved by a scan of %s\n",path,buf);
+		ret = 2;
+	}
+	else if (!c->root_set && scan_set_root(c, buf)){
+		ret = 2;
+	}
+	while (ret == 0 && (len = getdelim(&buf, &cap, '\0', f)) > 0){
+		if (buf[len-1] != '\0'){
+			fprintf(stderr,"state %s is truncated\n",path);
+			ret = 2;
+		}
+		else if (enque(c, buf, NULL, 0, NULL, NULL)){
+			ret = 2;
+		}
+	}
+	if (ret == 0 && ferror(f)){
+		fprintf(stderr,"error reading state %s\n",path);
+		ret = 2;
+	}
+	free(buf);
+	fclose(f);
+	if (ret){
+		destroy_q(c);
+		return ret;
+	}
+	return run(c);
+}
+
+/*
+ * Writes the directories left in the queue by a stopped scan to a state file at path, for scan_resume: a magic line,
+ * then root and every queued directory as null terminated paths. Written to a temporary name and renamed over path.
+ * Not available with inclusive, as partial sums of unfinished subtrees can't be continued.
+ * Returns 0 on success, 1 otherwise.
+ */
+int scan_save_state(scan_ctx* c, const char* path){
+	FILE* f;
+	node* n;
+	int h, i, err;
+	char* tmp_path;
+	if (c->opt.inclusive || !c->root_set){
+		fprintf(stderr,"%s\n",c->opt.inclusive ? "can't save the state of an inclusive scan" : "no scan to save");
+		return 1;
+	}
+	if ((tmp_path = malloc(strlen(path) + 5)) == NULL){
+		fprintf(stderr,"error allocating state name\n");
+		return 1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+	if ((f = fopen(tmp_path, "w")) == NULL){
+		fprintf(stderr,"error creating state %s, errno %d\n",tmp_path,errno);
+		free(tmp_path);
+		return 1;
+	}
+	pthread_mutex_lock(&c->q_mutex);
+	fputs(STATE_MAGIC, f);
+	fwrite(c->root, 1, strlen(c->root) + 1, f);
+	for (n = c->q.head ; n != NULL ; n = n->next){
+		fwrite(n->name, 1, strlen(n->name) + 1, f);
+	}
+	for (h=0 ; h<2 ; h++){
+		for (i=0 ; i<c->q.heap_len[h] ; i++){
+			fwrite(c->q.heap[h][i]->name, 1, strlen(c->q.heap[h][i]->name) + 1, f);
+		}
+	}
+	pthread_mutex_unlock(&c->q_mutex);
+	err = ferror(f);
+	if (fclose(f) || err || rename(tmp_path, path)){
+		fprintf(stderr,"error writing state %s, errno %d\n",path,errno);
+		unlink(tmp_path);
+		free(tmp_path);
+		return 1;
+	}
+	free(tmp_path);
+	return 0;
+}
+
+/*
+ * Scans whatever is queued: creates the threads and joins them back (and the controller, with auto_threads).
+ * Returns 0 on success, 1 if some thread failed, 2 if all of them did.
+ */
+static int run(scan_ctx* c){
+	long i, created;
+	int tmp, ret = 0, all = 0;
+	void* stat; //will hold exit code
+	pthread_t tuner;
+	c->idle = 0;
+	c->total = 0;
+	c->parked = 0;
+	c->limit = c->num;
+	c->tune_len = 0;
+	if (c->opt.auto_threads && !c->finished){
+		c->limit = c->num < 2 ? c->num : 2;
+		c->tuning = 1;
+		if (pthread_create(&tuner, NULL, tune_do, c)){
+			fprintf(stderr,"error creating thread count controller, scanning with %d threads\n",c->num);
+			c->limit = c->num;
+			c->tuning = 0;
+		}
+	}
+	for (i=0 ; i<c->num && !c->finished ; i++){ //create threads
+		__sync_fetch_and_add(&c->total, 1);// update one more created thread (will be used to tell if all threads are idle)
+		c->alive[i] = 1; //no need for atomicity, as only this thread will edit this slot
+		if (pthread_create(c->threads+i, NULL, thread_do, c->args+i)){
+			fprintf(stderr,"error in creating thread\n");
+			pthread_mutex_lock(&c->q_mutex); //threads already waiting may be waiting for this one, let them recount
+			c->alive[i] = 0;
+			__sync_fetch_and_sub(&c->total, 1);
+			pthread_cond_broadcast(&c->empty);
+			pthread_cond_broadcast(&c->park);
+			pthread_mutex_unlock(&c->q_mutex);
+			ret = 1;
+			break;
+		}
+	}
+	created = i;
+	for (i=0 ; i<created ; i++){ //join all threads back
+		stat = NULL; //see what this specific thread returned
+		tmp = pthread_join(c->threads[i], &stat);
+		if (tmp!=0 && tmp!=ESRCH){ //joined failed for other reason than thread does not exsist
+			fprintf(stderr,"error joining thread %ld\n",i);
+			ret = 1;
+		}
+		else if (((long)stat)!=0){ //this thread returned 1 for failure.
+			ret = 1;
+			all++;
+		}
+		c->alive[i] = 0; //joined
+	}
+	if (c->tuning){
+		pthread_mutex_lock(&c->q_mutex);
+		c->tuning = 0;
+		pthread_cond_signal(&c->tick);
+		pthread_mutex_unlock(&c->q_mutex);
+		pthread_join(tuner, NULL);
+	}
+	if (!c->finished){
+		destroy_q(c); //left over if threads failed, while a stopped scan keeps it for scan_save_state
+	}
+	if (created == 0){
+		return c->finished ? 0 : 2;
+	}
+	return all == created ? 2 : ret;
+}
+
+/*
+ * Stops the scan: raises the finished flag (so no thread is created anymore, in this run or later ones) and wakes
+ * all waiting threads. Each thread leaves after the directory it is on, and queued directories are kept (see top of
+ * file). Takes q_mutex, so it must not be called from a signal handler. Can be called more than once.
+ */
+void scan_cancel(scan_ctx* c){
+	pthread_mutex_lock(&c->q_mutex);
+	c->finished = 1;
+	pthread_cond_broadcast(&c->empty);
+	pthread_cond_broadcast(&c->park);
+	pthread_mutex_unlock(&c->q_mutex);
+}
+
+/*
+ * Returns 1 if scan_cancel was called, 0 otherwise.
+ */
+int scan_cancelled(scan_ctx* c){
+	return c->finished != 0;
+}
+
+/*
+ * Fills out with the counters of thread (0..threads-1), or with their sum if thread is -1.
+ * Read without locks, so while scanning the result is a close estimate.
+ */
+void scan_get_stats(scan_ctx* c, int thread, scan_stats* out){
+	int i, last = thread < 0 ? c->num : thread + 1;
+	memset(out, 0, sizeof(*out));
+	for (i = thread < 0 ? 0 : thread ; i<last ; i++){
+		out->dirs += c->stats[i].dirs;
+		out->files += c->stats[i].files;
+		out->bytes += c->stats[i].bytes;
+		out->lock_wait_ns += c->stats[i].lock_wait_ns;
+		out->empty_wait_ns += c->stats[i].empty_wait_ns;
+		out->pruned_match += c->stats[i].pruned_match;
+		out->pruned_depth += c->stats[i].pruned_depth;
+		out->pruned_mount += c->stats[i].pruned_mount;
+		out->ops += c->stats[i].ops;
+		out->op_ns += c->stats[i].op_ns;
+	}
+}
+
+/*
+ * Reports the number of queued directories, idle threads and live threads, read without the lock.
+ */
+void scan_queue_state(scan_ctx* c, int* queued, int* idle, int* threads){
+	*queued = c->q.len;
+	*idle = c->idle < c->total ? c->idle : c->total; //idle is raised past total while threads are leaving
+	*threads = c->total;
+}
+
+/*
+ * Returns the number of threads currently allowed to scan (changes while scanning with auto_threads).
+ */
+int scan_thread_limit(scan_ctx* c){
+	return c->limit;
+}
+
+/*
+ * Prints how the number of scanning threads was tuned in the last run (auto_threads), one "<limit> at <time>" per
+ * change, to out.
+ */
+void scan_tune_report(scan_ctx* c, FILE* out){
+	int i;
+	if (!c->opt.auto_threads || c->tune_len == 0){
+		return;
+	}
+	fprintf(out,"Threads (auto, up to %d):", c->num);
+	for (i=0 ; i<c->tune_len ; i++){
+		fprintf(out,"%s %d at %.1f s", i ? "," : "", c->tune_log[i].limit, c->tune_log[i].seconds);
+	}
+	fputs("\n", out);
+}
+
+/*
+ * Returns the inclusive size of the last scanned tree (with inclusive, once the whole tree finished).
+ */
+unsigned long scan_root_total(scan_ctx* c){
+	return c->root_total;
+}
+
+/*
+ * Returns the number of hard links that were not counted, as another link to the same file already was (disk usage).
+ */
+unsigned long scan_hardlink_dups(scan_ctx* c){
+	int i;
+	unsigned long dups = 0;
+	for (i=0 ; c->inodes != NULL && i<SHARDS ; i++){
+		dups += c->inodes[i].dups;
+	}
+	return dups;
+}
+
+/*
+ * Takes half of the queue (the oldest, shallowest directories, or with inode_order the ones farthest ahead of the
+ * sweep) away from a running scan, and passes each of their paths to fn. Nodes are taken out under the queue lock,
+ * and passed after it was released.
+ * Not available with inclusive (the subtrees they belong to would never finish).
+ * Returns the number of directories given away.
+ */
+int scan_give_away(scan_ctx* c, void (*fn)(void* arg, const char* path), void* arg){
+	node* n, *taken = NULL, **last = &taken;
+	int i, h, len;
+	if (c->opt.inclusive){
+		return 0;
+	}
+	pthread_mutex_lock(&c->q_mutex);
+	len = (c->q.len+1)/2;
+	for (i=0 ; i<len ; i++){
+		if (c->opt.inode_order){ //a heap is still a heap without its last items
+			h = c->q.heap_len[!c->q.cur] > 0 ? !c->q.cur : c->q.cur;
+			n = c->q.heap[h][--c->q.heap_len[h]];
+			c->q.len--;
+		}
+		else{
+			n = q_take(&c->q, 0);
+		}
+		n->next = NULL;
+		*last = n; //appended, so they are passed in the order they were taken
+		last = &n->next;
+	}
+	pthread_mutex_unlock(&c->q_mutex);
+	while (taken != NULL){
+		n = taken->next;
+		fn(arg, taken->name);
+		destroy_node(taken);
+		taken = n;
+	}
+	return len;
+}
+
+/*
+ * Sums sizes of files directly inside directory path in the calling thread (like a scan of one directory, but
+ * without queueing). In disk usage mode links are not deduplicated here (the set only knows the first link counted
+ * in the scan). If child is not NULL, it is called with the full path of every sub directory that is not pruned.
+ * Returns 0 on success, 1 otherwise (errno is kept, so ENOENT tells the directory is gone; ENOMEM if child failed).
+ */
+int scan_level(scan_ctx* c, const char* path, unsigned long* size, int (*child)(void* arg, const char* path), void* arg){
+	DIR* cur;
+	struct dirent* entry;
+	struct stat info;
+	char full[PATH_MAX];
+	int err, type, statted, depth = c->opt.max_depth >= 0 ? dir_depth(c, path) + 1 : 0;
+	*size = 0;
+	if ((cur = opendir(path)) == NULL){
+		return 1;
+	}
+	errno = 0;
+	while ((entry = readdir(cur)) != NULL){
+		type = entry_type(cur, entry->d_name, entry->d_type, &info, &statted);
+		if (type == DT_DIR && child != NULL && strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..") &&
+				!prune_dir(c, path, entry->d_name, depth)){
+			err = snprintf(full, PATH_MAX, "%s/%s", path, entry->d_name) >= PATH_MAX ? ENAMETOOLONG :
+					child(arg, full) ? ENOMEM : 0;
+			if (err){
+				closedir(cur);
+				errno = err;
+				return 1;
+			}
+		}
+		else if (type == DT_REG && (statted || fstatat(dirfd(cur), entry->d_name, &info, 0) == 0)){
+			*size += file_bytes(c, &info); //a file removed under us is just not counted
+		}
+		errno = 0;
+	}
+	err = errno;
+	closedir(cur);
+	errno = err;
+	return err != 0;
+}
+
+/*
+ * Decides whether sub directory name of parent is left out by the pruning filters.
+ * Returns SCAN_PRUNED_DEPTH, SCAN_PRUNED_MATCH, or 0 if it would be scanned.
+ */
+int scan_pruned(scan_ctx* c, const char* parent, const char* name){
+	return prune_dir(c, parent, name, c->opt.max_depth >= 0 ? dir_depth(c, parent) + 1 : 0);
+}
+
+/*
+ * Prints index hit and miss statistics to out, and an estimate of time saved:
+ * average cost of statting a file on misses times number of files not statted on hits.
+ */
+void scan_index_report(scan_ctx* c, FILE* out){
+	int i;
+	unsigned long hits = 0, misses = 0, hit_files = 0, miss_files = 0, miss_ns = 0;
+	if (c->logs == NULL){
+		return;
+	}
+	for (i=0 ; i<c->num ; i++){
+		hits += c->logs[i].hits;
+		misses += c->logs[i].misses;
+		hit_files += c->logs[i].hit_files;
+		miss_files += c->logs[i].miss_files;
+		miss_ns += c->logs[i].miss_ns;
+	}
+	fprintf(out,"Index: %lu directories reused, %lu rescanned, %lu file stats skipped", hits, misses, hit_files);
+	if (miss_files > 0){
+		fprintf(out,", about %.3f seconds saved", (double)miss_ns / miss_files * hit_files / 1e9);
+	}
+	fputs("\n", out);
+}
+
+/*
+ * Writes the records logged by all threads as the new index.
+ * File is written to a temporary name through a shared mapping, sorted in place and then renamed over index_path,
+ * so a crash never leaves a half written index behind. A cancelled scan would drop unvisited directories, so call it
+ * only after a complete one.
+ * Returns 0 on success (or without an index), 1 otherwise.
+ */
+int scan_index_save(scan_ctx* c){
+	int i, fd;
+	unsigned long count = 0;
+	size_t len;
+	index_header* new_index;
+	index_rec* recs;
+	const char* path = c->opt.index_path;
+	char* tmp_path;
+	if (c->logs == NULL){
+		return 0;
+	}
+	if ((tmp_path = malloc(strlen(path) + 5)) == NULL){
+		fprintf(stderr,"error allocating index name\n");
+		return 1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+	for (i=0 ; i<c->num ; i++){
+		count += c->logs[i].len;
+	}
+	len = sizeof(index_header) + count * sizeof(index_rec);
+	if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, len)){
+		fprintf(stderr,"error creating index %s, errno %d\n",tmp_path,errno);
+		if (fd >= 0){
+			close(fd);
+		}
+		free(tmp_path);
+		return 1;
+	}
+	new_index = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (new_index == MAP_FAILED){
+		fprintf(stderr,"error mapping index %s, errno %d\n",tmp_path,errno);
+		free(tmp_path);
+		return 1;
+	}
+	new_index->magic = INDEX_MAGIC;
+	new_index->count = count;
+	new_index->disk_usage = c->opt.disk_usage;
+	new_index->pad = 0;
+	recs = (index_rec*)(new_index + 1);
+	for (i=0 ; i<c->num ; i++){
+		memcpy(recs, c->logs[i].recs, c->logs[i].len * sizeof(index_rec));
+		recs += c->logs[i].len;
+	}
+	qsort(new_index + 1, count, sizeof(index_rec), cmp_rec);
+	if (msync(new_index, len, MS_SYNC) || rename(tmp_path, path)){
+		fprintf(stderr,"error writing index %s, errno %d\n",path,errno);
+		munmap(new_index, len);
+		free(tmp_path);
+		return 1;
+	}
+	munmap(new_index, len);
+	free(tmp_path);
+	return 0;
+}
+
+/*
+ * Merges all threads' aggregations and prints extensions (largest first) and non empty size buckets to out.
+ */
+void scan_aggregate_report(scan_ctx* c, FILE* out){
+	int i, b;
+	unsigned long j;
+	ext_entry* list;
+	aggregate all;
+	const char* units = "BKMGTPE";
+	if (c->aggs == NULL){
+		return;
+	}
+	memset(&all, 0, sizeof(all));
+	for (i=0 ; i<c->num ; i++){
+		for (b=0 ; b<BUCKETS ; b++){
+			all.bucket_files[b] += c->aggs[i].bucket_files[b];
+			all.bucket_bytes[b] += c->aggs[i].bucket_bytes[b];
+		}
+		for (j=0 ; j<c->aggs[i].cap ; j++){
+			if (c->aggs[i].exts[j].ext != NULL && agg_add(&all, c->aggs[i].exts[j].ext, c->aggs[i].exts[j].files, c->aggs[i].exts[j].bytes)){
+				fprintf(stderr,"error merging extension tables\n");
+				agg_free(&all);
+				return;
+			}
+		}
+	}
+	if ((list = malloc((all.len + 1) * sizeof(ext_entry))) == NULL){
+		fprintf(stderr,"error sorting extensions\n");
+		agg_free(&all);
+		return;
+	}
+	for (i=0, j=0 ; j<all.cap ; j++){
+		if (all.exts[j].ext != NULL){
+			list[i++] = all.exts[j];
+		}
+	}
+	qsort(list, i, sizeof(ext_entry), cmp_ext);
+	fprintf(out,"By extension:\n");
+	for (b=0 ; b<i ; b++){
+		fprintf(out,"\t%s%s: %lu files, %lu bytes\n", list[b].ext[0] ? "." : "", list[b].ext[0] ? list[b].ext : "(none)",
+				list[b].files, list[b].bytes);
+	}
+	free(list);
+	fprintf(out,"By size:\n");
+	for (b=0 ; b<BUCKETS ; b++){
+		if (all.bucket_files[b] == 0){
+			continue;
+		}
+		if (b == 0){
+			fprintf(out,"\t0: %lu files\n", all.bucket_files[0]);
+		}
+		else{ //[2^(b-1), 2^b) as 2^(n%10) with unit n/10
+			fprintf(out,"\t[%lu%c, %lu%c): %lu files, %lu bytes\n", 1UL << ((b-1) % 10), units[(b-1) / 10],
+					1UL << (b % 10), units[b / 10], all.bucket_files[b], all.bucket_bytes[b]);
+		}
+	}
+	agg_free(&all);
+}
+
+/*
+ * Releases all resources of a context (which must not be scanning).
+ */
+void scan_destroy(scan_ctx* c){
+	int i;
+	if (c == NULL){
+		return;
+	}
+	destroy_q(c);
+	if (c->aggs != NULL){
+		for (i=0 ; i<c->num ; i++){
+			agg_free(c->aggs + i);
+		}
+	}
+	if (c->inodes != NULL){
+		for (i=0 ; i<SHARDS ; i++){
+			free(c->inodes[i].keys);
+			pthread_mutex_destroy(&c->inodes[i].lock);
+		}
+	}
+	if (c->logs != NULL){
+		for (i=0 ; i<c->num ; i++){
+			free(c->logs[i].recs);
+		}
+	}
+	if (c->lists != NULL){
+		for (i=0 ; i<c->num ; i++){
+			free(c->lists[i].items);
+			free(c->lists[i].names);
+		}
+	}
+	if (c->old_index != NULL){
+		munmap(c->old_index, c->old_index_len);
+	}
+	pattern_free(&c->excludes);
+	pattern_free(&c->includes);
+	free(c->root);
+	free(c->threads);
+	free(c->alive);
+	free(c->args);
+	free(c->stats);
+	free(c->aggs);
+	free(c->inodes);
+	free(c->logs);
+	free(c->lists);
+	free(c->tune_log);
+	free(c->q.heap[0]);
+	free(c->q.heap[1]);
+	pthread_mutex_destroy(&c->q_mutex);
+	pthread_cond_destroy(&c->empty);
+	pthread_cond_destroy(&c->park);
+	pthread_cond_destroy(&c->tick);
+	free(c);
+}
+
+/*
+ * Logic for thread tasks.
+ * Notice that no data is allocated by this function, but it is responsible for the name string it dequeued.
+ * Logic:
+ * 	untill stopped or get flag that all threads are idle, dequeue a dir name
+ * 	(dedque will block untill queue is not empty, and tells to leave if the scan was stopped)
+ * 	call get_size to sum directory file sizes (this function also queues new dirs it encounters)
+ * 	pass the result to the callback.
+ * 	with inclusive, add the size to this directory's subtree and finish it (if none of its children are pending).
+ *
+ */
+static void* thread_do(void* arg){
+	scan_ctx* c = ((thread_arg*)arg)->c;
+	long serial = ((thread_arg*)arg)->serial; //this thread's serial number
+	int done = 0; //dequeue will change to 1 when all threads become idle and program needs to finish
+	char* name = NULL;
+	unsigned long size;
+	int pruned, failed;
+	subtree* parent, *self = NULL;
+	counters* st = c->stats + serial; //private, so no lock is needed to update it
+	while (1){
+		name = dequeue(c, st, &done, &parent);
+		if ((name == NULL)){
+			if (done){
+				break;
+			}
+			else{ //error in dequeue
+				c->alive[serial]=0; //update that this thread is dead
+				__sync_fetch_and_sub(&c->total, 1); //update that there is one less thread
+				fprintf(stderr,"error in dequeue for thread %ld \n",serial); //c, no resources to release
+				return (void*)1;
+			}
+		}
+		if (c->opt.inclusive){
+			self = calloc(1, sizeof(subtree));
+			if (self == NULL || (self->name = strdup(name)) == NULL){
+				free(self);
+				fprintf(stderr,"error allocating subtree, thread %ld\n",serial);
+				thread_fail(c, serial, name, NULL, parent); //this directory's pending unit of its parent
+			}
+			self->pending = 1; //for our own scan, released below
+			self->parent = parent;
+		}
+		size = get_size(c, name, serial, self, &pruned);
+		if (pruned){ //not part of the scan, but it still has to release its parent
+			if (c->opt.inclusive){
+				failed = subtree_done(c, self, serial);
+				self = NULL; //released even if reporting failed
+				CHECK_THREAD((failed),(stderr,"error reporting subtree, thread %ld\n",serial));
+			}
+			free(name);
+			name = NULL;
+			continue;
+		}
+		st->dirs++;
+		st->bytes += size;
+		if (c->opt.callback != NULL){
+			CHECK_THREAD((c->opt.callback(c->opt.arg, serial, SCAN_DIR, name, size)),(stderr,"error reporting dir %s, thread %ld\n",name,serial));
+		}
+		if (c->opt.inclusive){
+			__sync_fetch_and_add(&self->total, size);
+			failed = subtree_done(c, self, serial);
+			self = NULL; //released even if reporting failed
+			CHECK_THREAD((failed),(stderr,"error reporting subtree, thread %ld\n",serial));
+		}
+		free(name);
+		name = NULL;
+	}
+	return (void*)0;
+}
+
+/*
+ * Releases one pending unit of subtree s (its own scan, or one of its children).
+ * If this was the last one, the subtree is complete: report it, add it to its parent and release the parent in turn.
+ * Walks up iteratively, so a chain of directories finished by one child is handled in one call.
+ * Returns 0 on success, 1 if the callback failed for any of them (the walk is completed anyway).
+ */
+static int subtree_done(scan_ctx* c, subtree* s, long serial){
+	subtree* parent;
+	int ret = 0;
+	while (s != NULL && __sync_sub_and_fetch(&s->pending, 1) == 0){
+		parent = s->parent;
+		if (c->opt.callback != NULL && c->opt.callback(c->opt.arg, serial, SCAN_SUBTREE, s->name, s->total)){
+			ret = 1;
+		}
+		if (parent == NULL){
+			c->root_total = s->total; //only one thread can finish root, it is read after join
+		}
+		else{
+			__sync_fetch_and_add(&parent->total, s->total);
+		}
+		free(s->name);
+		free(s);
+		s = parent;
+	}
+	return ret;
+}
+
+/*
+ * Ends a scan thread that failed: closes cur, and frees name, if they are not NULL. self is the subtree whose
+ * pending unit this thread holds (NULL without inclusive), it is released like a finished scan, so the subtree
+ * (without what this thread didn't get to add) and its ancestors are still reported once their other children finish.
+ * Then the thread is counted out: condvars are signaled, in case this dying thread was the last one which all were
+ * waiting for (or a parked one may take its place).
+ */
+static void thread_fail(scan_ctx* c, long serial, char* name, DIR* cur, subtree* self){
+	if (cur != NULL){
+		closedir(cur);
+	}
+	if (self != NULL){
+		subtree_done(c, self, serial);
+	}
+	free(name);
+	c->alive[serial]=0;
+	__sync_fetch_and_sub(&c->total, 1);
+	pthread_cond_signal(&c->empty);
+	pthread_cond_broadcast(&c->park);
+	pthread_exit((void*)1);
+}
+
+/*
+ * Releases one pending unit of subtree s without reporting it, for a queued directory that will never be scanned.
+ * Subtrees (and their parents) left with nothing pending are freed.
+ */
+static void subtree_drop(subtree* s){
+	subtree* parent;
+	while (s != NULL && --s->pending == 0){ //threads are joined, no atomics needed
+		parent = s->parent;
+		free(s->name);
+		free(s);
+		s = parent;
+	}
+}
+
+/*
+ * Goes over all files in directory "name", and sums their sizes.
+ * directory sizes are not summed, but instead inserted into queue (except root and father pointers: "." "..")
+ * If self is not NULL (inclusive), every queued child is counted as pending work of self before it is queued.
+ * With an index, directory is looked up first, and its files are not statted if it did not change since last scan.
+ * With inode_order, the directory is read whole first and its entries are handled by inode number.
+ * Sets *pruned if the directory is not to be scanned at all (on another filesystem with one_fs).
+ */
+static unsigned long get_size(scan_ctx* c, char* name, long serial, subtree* self, int* pruned){
+	unsigned long size = 0, files = 0, ops = 1; //opening the directory is one
+	int seen, type, statted, why, pos = 0, depth = c->opt.max_depth >= 0 ? dir_depth(c, name) + 1 : 0; //depth of sub directories
+	unsigned char d_type;
+	char* entry;
+	ino_t ino;
+	entry_list* sorted = c->lists != NULL ? c->lists + serial : NULL;
+	struct stat info, dir_info;
+	struct timespec start, end, begin;
+	index_rec* old = NULL;
+	counters* st = c->stats + serial;
+	DIR *cur= NULL;
+	*pruned = 0;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	CHECK_THREAD((!(cur = opendir(name))),(stderr,"error opening dir %s thread %ld\n",name,serial)); //c
+	if (c->logs != NULL || c->opt.disk_usage || c->opt.one_fs){
+		CHECK_THREAD_DIR((fstat(dirfd(cur), &dir_info)),(stderr,"error getting stat info on dir %s, thread %ld, errno %d\n",name,serial,errno),cur);
+	}
+	if (c->opt.one_fs && dir_info.st_dev != c->root_dev){ //a mount point, leave it
+		CHECK_THREAD(closedir(cur),(stderr,"error closing dir"));
+		st->pruned_mount++;
+		st->ops++;
+		st->op_ns += ns_since(&begin);
+		*pruned = 1;
+		return 0;
+	}
+	if (c->opt.disk_usage){
+		size = file_bytes(c, &dir_info); //directory's own blocks
+	}
+	if (c->logs != NULL){
+		old = index_find(c, &dir_info); //NULL if new or changed
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+	if (sorted != NULL){
+		CHECK_THREAD_DIR((read_sorted(cur, sorted)),(stderr,"error while readdir on %s, thread %ld errno %d \n",name,serial,errno),cur);
+	}
+	errno = 0; //Distinguish errors for dir
+	while (next_entry(cur, sorted, &pos, &entry, &d_type, &ino)){ //get files in dir
+		ops++;
+		type = entry_type(cur, entry, d_type, &info, &statted);
+		//handle if current file is another dir
+		if (type == DT_DIR){
+			if (strcmp(entry, ".") == 0 || strcmp(entry, "..") == 0){
+				continue;
+			}
+			else if ((why = prune_dir(c, name, entry, depth)) != 0){
+				why == SCAN_PRUNED_DEPTH ? st->pruned_depth++ : st->pruned_match++;
+			}
+			else{
+				if (self != NULL){
+					__sync_fetch_and_add(&self->pending, 1); //before queueing, so self can't finish under the child
+				}
+				if (enque(c,name,entry,ino,self,st)){ //note this actualy adds new directory to dir
+					if (self != NULL){
+						__sync_fetch_and_sub(&self->pending, 1); //the child was not queued, our own unit keeps self alive
+					}
+					CHECK_THREAD_DIR(1,(stderr,"error adding dir %s to queue thread %ld\n",entry,serial),cur);
+				}
+			}
+		}
+		//if a regular file
+		else if (type == DT_REG && old == NULL){
+			CHECK_THREAD_DIR((!statted && fstatat(dirfd(cur), entry, &info, 0)),(stderr,"error getting stat info on file %s, thread %ld, errno %d\n",entry,serial,errno),cur);
+			if (c->opt.disk_usage && info.st_nlink > 1){
+				CHECK_THREAD_DIR(((seen = inode_seen(c, &info)) < 0),(stderr,"error allocating inode set, thread %ld\n",serial),cur);
+				if (seen){
+					continue;
+				}
+			}
+			size += file_bytes(c, &info);
+			files++;
+			if (c->aggs != NULL){
+				agg_file(c->aggs + serial, entry, file_bytes(c, &info));
+				CHECK_THREAD_DIR((c->aggs[serial].exts == NULL),(stderr,"error allocating extension table, thread %ld\n",serial),cur);
+			}
+		}
+	}
+	CHECK_THREAD_DIR((errno!=0),(stderr,"error while readdir on %s, thread %ld errno %d \n",name,serial,errno),cur);
+	CHECK_THREAD(closedir(cur),(stderr,"error closing dir"));
+	if (c->logs != NULL){
+		if (old != NULL){
+			size = old->size;
+			files = old->files;
+			c->logs[serial].hits++;
+			c->logs[serial].hit_files += files;
+		}
+		else{
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			c->logs[serial].misses++;
+			c->logs[serial].miss_files += files;
+			c->logs[serial].miss_ns += (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+		}
+		CHECK_THREAD((index_log_add(c->logs + serial, &dir_info, size, files)),(stderr,"error adding dir %s to index, thread %ld\n",name,serial));
+	}
+	st->files += files;
+	st->ops += ops;
+	st->op_ns += ns_since(&begin);
+	return size;
+}
+
+/*
+ * Gets the next entry of directory cur: from l (the whole directory, sorted by read_sorted) if it is not NULL,
+ * otherwise from readdir. *pos is the position in l, start it at 0.
+ * Returns 1 with the entry's name, d_type and inode number filled, 0 at the end (errno tells a readdir error).
+ */
+static int next_entry(DIR* cur, entry_list* l, int* pos, char** name, unsigned char* type, ino_t* ino){
+	struct dirent* entry;
+	if (l != NULL){
+		if (*pos == l->len){
+			return 0;
+		}
+		*name = l->names + l->items[*pos].name;
+		*type = l->items[*pos].type;
+		*ino = l->items[(*pos)++].ino;
+		return 1;
+	}
+	if ((entry = readdir(cur)) == NULL){
+		return 0;
+	}
+	*name = entry->d_name;
+	*type = entry->d_type;
+	*ino = entry->d_ino;
+	return 1;
+}
+
+/*
+ * Reads all entries of directory cur into l (reusing its buffers, grown as needed) and sorts them by inode number.
+ * Returns 0 on success, 1 otherwise (errno is set).
+ */
+static int read_sorted(DIR* cur, entry_list* l){
+	struct dirent* entry;
+	sorted_entry* items;
+	char* names;
+	size_t len;
+	l->len = 0;
+	l->names_len = 0;
+	errno = 0;
+	while ((entry = readdir(cur)) != NULL){
+		len = strlen(entry->d_name) + 1;
+		if (l->len == l->cap){
+			if ((items = realloc(l->items, (l->cap ? 2*l->cap : 256) * sizeof(sorted_entry))) == NULL){
+				errno = ENOMEM;
+				return 1;
+			}
+			l->items = items;
+			l->cap = l->cap ? 2*l->cap : 256;
+		}
+		if (l->names_len + len > l->names_cap){
+			if ((names = realloc(l->names, 2*l->names_cap + len + 4096)) == NULL){
+				errno = ENOMEM;
+				return 1;
+			}
+			l->names = names;
+			l->names_cap = 2*l->names_cap + len + 4096;
+		}
+		memcpy(l->names + l->names_len, entry->d_name, len);
+		l->items[l->len].ino = entry->d_ino;
+		l->items[l->len].name = l->names_len; //an offset, as names may move when growing
+		l->items[l->len++].type = entry->d_type;
+		l->names_len += len;
+	}
+	if (errno != 0){
+		return 1;
+	}
+	qsort(l->items, l->len, sizeof(sorted_entry), cmp_entry);
+	return 0;
+}
+
+/*
+ * Compare function for qsort, orders directory entries by inode number.
+ */
+static int cmp_entry(const void* a, const void* b){
+	ino_t x = ((sorted_entry*)a)->ino, y = ((sorted_entry*)b)->ino;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Returns the type (DT_DIR, DT_REG, ...) of a directory entry.
+ * For DT_UNKNOWN (filesystems that don't fill d_type) the entry is statted without following links, and *statted
+ * is set so a regular file's info is reused. An entry that can't be statted (removed meanwhile) is DT_UNKNOWN.
+ */
+static int entry_type(DIR* cur, const char* name, unsigned char d_type, struct stat* info, int* statted){
+	int err = errno;
+	*statted = 0;
+	if (d_type != DT_UNKNOWN){
+		return d_type;
+	}
+	if (fstatat(dirfd(cur), name, info, AT_SYMLINK_NOFOLLOW)){
+		errno = err; //not a readdir error
+		return DT_UNKNOWN;
+	}
+	*statted = 1;
+	return S_ISDIR(info->st_mode) ? DT_DIR : S_ISREG(info->st_mode) ? DT_REG : DT_UNKNOWN;
+}
+
+/*
+ * Decides whether sub directory name of parent, depth levels below root, is left out (see top of file).
+ * Returns SCAN_PRUNED_DEPTH, SCAN_PRUNED_MATCH (matches an exclude pattern and no include pattern), or 0 to scan it.
+ */
+static int prune_dir(scan_ctx* c, const char* parent, const char* name, int depth){
+	char path[PATH_MAX];
+	path[0] = '\0'; //built only if a pattern needs it
+	if (c->opt.max_depth >= 0 && depth > c->opt.max_depth){
+		return SCAN_PRUNED_DEPTH;
+	}
+	if (c->excludes.len == 0 || !pattern_match(&c->excludes, parent, name, path)){
+		return 0;
+	}
+	return pattern_match(&c->includes, parent, name, path) ? 0 : SCAN_PRUNED_MATCH;
+}
+
+/*
+ * Appends a copy of glob to l, growing it as needed.
+ * Returns 0 on success, 1 otherwise.
+ */
+static int pattern_add(pattern_list* l, const char* glob){
+	char** globs;
+	char* full;
+	int cap;
+	if (l->len == l->cap){
+		cap = l->cap ? 2*l->cap : 8;
+		if ((globs = realloc(l->globs, cap * sizeof(char*))) == NULL){
+			return 1;
+		}
+		l->globs = globs;
+		if ((full = realloc(l->full, cap)) == NULL){
+			return 1;
+		}
+		l->full = full;
+		l->cap = cap;
+	}
+	if ((l->globs[l->len] = strdup(glob)) == NULL){
+		return 1;
+	}
+	l->full[l->len++] = strchr(glob, '/') != NULL;
+	return 0;
+}
+
+/*
+ * Returns 1 if name (or parent/name, for patterns with a '/') matches any pattern in l, 0 otherwise.
+ * path is a PATH_MAX buffer for parent/name, filled on first use (empty string until then).
+ */
+static int pattern_match(pattern_list* l, const char* parent, const char* name, char* path){
+	int i;
+	for (i=0 ; i<l->len ; i++){
+		if (l->full[i]){
+			if (path[0] == '\0'){
+				snprintf(path, PATH_MAX, "%s/%s", parent, name);
+			}
+			if (fnmatch(l->globs[i], path, FNM_PATHNAME) == 0){
+				return 1;
+			}
+		}
+		else if (fnmatch(l->globs[i], name, 0) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Frees a pattern list and the patterns in it.
+ */
+static void pattern_free(pattern_list* l){
+	int i;
+	for (i=0 ; i<l->len ; i++){
+		free(l->globs[i]);
+	}
+	free(l->globs);
+	free(l->full);
+	memset(l, 0, sizeof(*l));
+}
+
+/*
+ * Returns how many levels below root directory name is.
+ */
+static int dir_depth(scan_ctx* c, const char* name){
+	int n = 0;
+	for ( ; *name ; name++){
+		n += *name == '/';
+	}
+	return n - c->root_slashes;
+}
+
+/*
+ * Adds a file of the given bytes to a thread's aggregation: its extension (after the last '.', unless that is
+ * the first character) and its size bucket. On allocation failure the table is dropped and a->exts is left NULL.
+ */
+static void agg_file(aggregate* a, char* name, unsigned long bytes){
+	char* dot = strrchr(name, '.');
+	int b = bytes ? 64 - __builtin_clzl(bytes) : 0; //number of significant bits
+	a->bucket_files[b]++;
+	a->bucket_bytes[b] += bytes;
+	if (agg_add(a, dot != NULL && dot != name ? dot + 1 : "", 1, bytes)){
+		agg_free(a);
+	}
+}
+
+/*
+ * Adds files and bytes to extension ext in a's table, copying ext if it is new. Doubles the table when half full.
+ * Returns 0 on success, 1 on allocation failure.
+ */
+static int agg_add(aggregate* a, char* ext, unsigned long files, unsigned long bytes){
+	unsigned long i, j, cap;
+	ext_entry* tmp;
+	if (2 * (a->len + 1) > a->cap){
+		cap = a->cap ? 2 * a->cap : 64;
+		if ((tmp = calloc(cap, sizeof(ext_entry))) == NULL){
+			return 1;
+		}
+		for (i=0 ; i<a->cap ; i++){
+			if (a->exts[i].ext != NULL){
+				for (j = hash_name(a->exts[i].ext) & (cap-1) ; tmp[j].ext != NULL ; j = (j+1) & (cap-1));
+				tmp[j] = a->exts[i];
+			}
+		}
+		free(a->exts);
+		a->exts = tmp;
+		a->cap = cap;
+	}
+	for (i = hash_name(ext) & (a->cap-1) ; a->exts[i].ext != NULL ; i = (i+1) & (a->cap-1)){
+		if (strcmp(a->exts[i].ext, ext) == 0){
+			a->exts[i].files += files;
+			a->exts[i].bytes += bytes;
+			return 0;
+		}
+	}
+	if ((a->exts[i].ext = strdup(ext)) == NULL){
+		return 1;
+	}
+	a->exts[i].files = files;
+	a->exts[i].bytes = bytes;
+	a->len++;
+	return 0;
+}
+
+/*
+ * Frees the extension table of an aggregation, leaving it empty (size buckets are kept).
+ */
+static void agg_free(aggregate* a){
+	unsigned long i;
+	for (i=0 ; i<a->cap ; i++){
+		free(a->exts[i].ext);
+	}
+	free(a->exts);
+	a->exts = NULL;
+	a->cap = 0;
+	a->len = 0;
+}
+
+/*
+ * Compare function for qsort, orders extensions by bytes, largest first.
+ */
+static int cmp_ext(const void* a, const void* b){
+	unsigned long x = ((ext_entry*)a)->bytes, y = ((ext_entry*)b)->bytes;
+	return (x < y) - (x > y);
+}
+
+/*
+ * Bytes a file counts for: allocated bytes in disk usage mode, apparent size otherwise.
+ */
+static unsigned long file_bytes(scan_ctx* c, struct stat* info){
+	return c->opt.disk_usage ? (unsigned long)info->st_blocks * 512 : (unsigned long)info->st_size; //st_blocks is always in 512B units
+}
+
+/*
+ * Adds the (device, inode) of a file with several links to the set of counted files.
+ * Returns 1 if it was already there (file was counted by another link), 0 if it was added, -1 on allocation error.
+ * Only the shard the key hashes to is locked. Shards grow (doubling) when half full.
+ */
+static int inode_seen(scan_ctx* c, struct stat* info){
+	uint64_t dev = info->st_dev, ino = info->st_ino, h, *tmp;
+	unsigned long i, j, cap;
+	inode_shard* shard;
+	h = inode_hash(dev, ino);
+	shard = c->inodes + (h % SHARDS);
+	h /= SHARDS; //rest of the bits pick the slot
+	pthread_mutex_lock(&shard->lock);
+	if (2*(shard->len+1) > shard->cap){
+		cap = shard->cap ? 2*shard->cap : 256;
+		if ((tmp = calloc(2*cap, sizeof(uint64_t))) == NULL){
+			pthread_mutex_unlock(&shard->lock);
+			return -1;
+		}
+		for (i=0 ; i<shard->cap ; i++){ //rehash
+			if (shard->keys[2*i+1] != 0){
+				for (j = (inode_hash(shard->keys[2*i], shard->keys[2*i+1]) / SHARDS) & (cap-1) ; tmp[2*j+1] != 0 ;
+						j = (j+1) & (cap-1));
+				tmp[2*j] = shard->keys[2*i];
+				tmp[2*j+1] = shard->keys[2*i+1];
+			}
+		}
+		free(shard->keys);
+		shard->keys = tmp;
+		shard->cap = cap;
+	}
+	for (i = h & (shard->cap-1) ; shard->keys[2*i+1] != 0 ; i = (i+1) & (shard->cap-1)){
+		if (shard->keys[2*i] == dev && shard->keys[2*i+1] == ino){
+			shard->dups++;
+			pthread_mutex_unlock(&shard->lock);
+			return 1;
+		}
+	}
+	shard->keys[2*i] = dev;
+	shard->keys[2*i+1] = ino;
+	shard->len++;
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+/*
+ * Mixes an inode's device and number (splitmix64 finalizer over both), so sequential inode numbers spread over the
+ * shards and over the slots of each shard.
+ */
+static uint64_t inode_hash(uint64_t dev, uint64_t ino){
+	uint64_t h = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+/*
+ * Maps the index file at path (if it exists) for lookups during the scan.
+ * A missing file is not an error, it means this is the first scan. A file that is not a valid index is.
+ * Returns 0 on success, 1 otherwise.
+ */
+static int index_load(scan_ctx* c, const char* path){
+	struct stat info;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0){
+		if (errno == ENOENT){
+			return 0;
+		}
+		fprintf(stderr,"error opening index %s, errno %d\n",path,errno);
+		return 1;
+	}
+	if (fstat(fd, &info)){
+		close(fd);
+		fprintf(stderr,"error getting stat info on index %s, errno %d\n",path,errno);
+		return 1;
+	}
+	c->old_index_len = info.st_size;
+	if (c->old_index_len < sizeof(index_header)){
+		close(fd);
+		fprintf(stderr,"index %s is too short\n",path);
+		return 1;
+	}
+	c->old_index = mmap(NULL, c->old_index_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //mapping stays valid
+	if (c->old_index == MAP_FAILED){
+		c->old_index = NULL;
+		fprintf(stderr,"error mapping index %s, errno %d\n",path,errno);
+		return 1;
+	}
+	if (c->old_index->magic != INDEX_MAGIC || c->old_index_len != sizeof(index_header) + c->old_index->count * sizeof(index_rec)){
+		fprintf(stderr,"%s is not a valid index\n",path);
+		return 1; //unmapped by scan_destroy
+	}
+	if (c->old_index->disk_usage != (uint32_t)c->opt.disk_usage){ //sizes of the other kind, start over
+		fprintf(stderr,"index %s was made %s disk usage mode, ignoring it\n",path,c->opt.disk_usage ? "without" : "in");
+		munmap(c->old_index, c->old_index_len);
+		c->old_index = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Looks up the directory described by info in previous index.
+ * Returns its record if found and unchanged (same mtime and ctime), NULL otherwise.
+ * Index is read only during the scan, so no locking is needed.
+ */
+static index_rec* index_find(scan_ctx* c, struct stat* info){
+	index_rec key, *rec;
+	if (c->old_index == NULL){
+		return NULL;
+	}
+	key.dev = info->st_dev;
+	key.ino = info->st_ino;
+	rec = bsearch(&key, c->old_index + 1, c->old_index->count, sizeof(index_rec), cmp_rec);
+	if (rec == NULL || rec->mtime_sec != info->st_mtim.tv_sec || rec->mtime_nsec != info->st_mtim.tv_nsec ||
+			rec->ctime_sec != info->st_ctim.tv_sec || rec->ctime_nsec != info->st_ctim.tv_nsec){
+		return NULL;
+	}
+	return rec;
+}
+
+/*
+ * Appends a record for a scanned directory to a thread's log, growing it as needed.
+ * Returns 0 on success, 1 otherwise.
+ */
+static int index_log_add(index_log* log, struct stat* info, unsigned long size, unsigned long files){
+	index_rec* tmp;
+	if (log->len == log->cap){
+		log->cap = log->cap ? 2*log->cap : 1024;
+		if ((tmp = realloc(log->recs, log->cap * sizeof(index_rec))) == NULL){
+			return 1;
+		}
+		log->recs = tmp;
+	}
+	tmp = log->recs + log->len++;
+	tmp->dev = info->st_dev;
+	tmp->ino = info->st_ino;
+	tmp->mtime_sec = info->st_mtim.tv_sec;
+	tmp->mtime_nsec = info->st_mtim.tv_nsec;
+	tmp->ctime_sec = info->st_ctim.tv_sec;
+	tmp->ctime_nsec = info->st_ctim.tv_nsec;
+	tmp->size = size;
+	tmp->files = files;
+	return 0;
+}
+
+/*
+ * qsort and bsearch comparator, orders index records by device and then inode.
+ */
+static int cmp_rec(const void* a, const void* b){
+	const index_rec* x = a, *y = b;
+	if (x->dev != y->dev){
+		return (x->dev > y->dev) - (x->dev < y->dev);
+	}
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+/*
+ * Takes a node out of the queue and returns a pointer to the string it contained.
+ * Recieves a pointer to a flag "done" to signal that the returned value was 0 not due to an error (work is done)
+ *
+ * If the queue is empty, this thread will wait for cond var empty.
+ * The is all threads but one are idle, this thread will not wait as well but wake every body up as work is done.
+ * If the scan was stopped, done is set as well, and whatever is queued is left there.
+ *
+ */
+static char* dequeue(scan_ctx* c, counters* st, int *done, subtree** parent){
+	char *name = NULL;
+	struct timespec start;
+	if (q_lock(c, st)){ //failed acquiring mutex
+		fprintf(stderr,"error in dequeue mutex acquire");
+		return NULL;
+	}
+	while (!c->finished && !(EMPTY(c) && ALL_IDLE(c))){
+		if (c->total - c->parked > c->limit){ //over the limit (auto_threads), park until the controller raises it
+			if (!EMPTY(c)){
+				pthread_cond_signal(&c->empty); //the wakeup that brought us here may have been meant for an item
+			}
+			c->idle++;
+			c->parked++;
+			pthread_cond_wait(&c->park, &c->q_mutex); //c
+			c->parked--;
+			c->idle--;
+		}
+		else if (EMPTY(c)){
+			c->idle++; //update counter that this thread is also idle, okay to increment since we are under a lock
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			pthread_cond_wait(&c->empty, &c->q_mutex); //c
+			st->empty_wait_ns += ns_since(&start);
+			c->idle--; //update counter that this thread is also idle, okay to decrement since we are under a lock
+		}
+		else{
+			break;
+		}
+	}
+	if (c->finished){ //stopped, scan_cancel already woke everybody
+		pthread_mutex_unlock(&c->q_mutex);
+		*done = 1;
+		return NULL;
+	}
+	if (EMPTY(c) && LAST(c)){ //all threads finished working
+		pthread_cond_broadcast(&c->empty);
+		pthread_cond_broadcast(&c->park);
+		c->idle = c->idle + 2; //so waking threads still know we are done (they decrement idle when they exit- this way they know a different thread finished)
+	}
+	if ((EMPTY(c) && ALL_IDLE(c))){
+		c->idle++; //to cancel decrement action going out of while loop
+		if (pthread_mutex_unlock(&c->q_mutex)){
+			fprintf(stderr,"error in dequeue mutex release"); //c (doesn't matter as means release failed)
+			return NULL;
+		}
+		*done = 1; //signal caller we finished working
+		return NULL;
+	}
+	if (EMPTY(c)){
+		pthread_mutex_unlock(&c->q_mutex);
+		return NULL;
+	}
+	//done with all the Sh*t, now this is a normal dequeue assuming the queue is not empty, no cpoints until end of code
+	node* tmp = q_take(&c->q, c->opt.inode_order); //Guaranteed not to be NULL
+	if (pthread_mutex_unlock(&c->q_mutex)){
+		destroy_node(tmp); //free node that was taken out.
+		fprintf(stderr,"error in dequeue mutex release"); //cancelation point, but mutex failed to be freed anyway
+		return NULL;
+	}
+	name = tmp->name;
+	*parent = tmp->parent;
+	free(tmp); //free node that was taken out, note that we keep the allocated string
+	return name;
+}
+
+/*
+ * Acquires q_mutex. In a scanning thread (st is its counters), time spent waiting for it is counted.
+ * Returns what pthread_mutex_lock returned.
+ */
+static int q_lock(scan_ctx* c, counters* st){
+	struct timespec start;
+	int ret;
+	if (st == NULL){ //queuing root
+		return pthread_mutex_lock(&c->q_mutex);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = pthread_mutex_lock(&c->q_mutex);
+	st->lock_wait_ns += ns_since(&start);
+	return ret;
+}
+
+/*
+ * Auto thread count controller, runs alongside the scanning threads while c->tuning (see top of file).
+ * Holds q_mutex except while waiting for the next sample, so the limit, idle and parked counts are consistent.
+ */
+static void* tune_do(void* arg){
+	scan_ctx* c = arg;
+	scan_stats now;
+	struct timespec start, last, wake;
+	unsigned long prev_ops, prev_ns;
+	double rate, prev_rate = 0, lat, best_lat = 0;
+	int move = 0, hold = 0, undo = 0, from, free_idle, step, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	scan_get_stats(c, -1, &now); //counters accumulate over runs
+	prev_ops = now.ops;
+	prev_ns = now.op_ns;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = wake = start;
+	pthread_mutex_lock(&c->q_mutex);
+	tune_note(c, &start);
+	while (c->tuning){
+		wake.tv_nsec += TUNE_MS * 1000000L;
+		wake.tv_sec += wake.tv_nsec / 1000000000L;
+		wake.tv_nsec %= 1000000000L;
+		while (c->tuning && pthread_cond_timedwait(&c->tick, &c->q_mutex, &wake) != ETIMEDOUT);
+		scan_get_stats(c, -1, &now);
+		if (!c->tuning || now.ops == prev_ops){ //nothing finished in this sample (one huge directory), wait for more
+			continue;
+		}
+		rate = (now.ops - prev_ops) / (ns_since(&last) / 1e9);
+		lat = (double)(now.op_ns - prev_ns) / (now.ops - prev_ops);
+		clock_gettime(CLOCK_MONOTONIC, &last);
+		prev_ops = now.ops;
+		prev_ns = now.op_ns;
+		best_lat = best_lat == 0 || lat < best_lat ? lat : best_lat;
+		free_idle = c->idle - c->parked; //idle threads that are allowed to scan
+		from = c->limit;
+		if ((move > 0 && rate < prev_rate * 1.05) || (move < 0 && rate < prev_rate * 0.95)){ //did not pay, undo and stay
+			c->limit = undo;
+			hold = TUNE_HOLD;
+			move = 0;
+		}
+		else if (hold > 0){
+			hold--;
+			move = 0;
+		}
+		else if (c->q.len > 0 && free_idle <= 0 && c->limit < c->num && (c->limit < cpus || lat > 2 * best_lat)){
+			undo = c->limit;
+			step = c->limit / 4 > 1 ? c->limit / 4 : 1;
+			c->limit = c->limit + step < c->num ? c->limit + step : c->num;
+			move = 1;
+		}
+		else if (2 * free_idle > c->limit && c->limit > 1){
+			undo = c->limit;
+			c->limit--;
+			move = -1;
+		}
+		else{
+			move = 0;
+		}
+		prev_rate = rate;
+		if (c->limit != from){
+			if (c->limit > from){
+				pthread_cond_broadcast(&c->park);
+			}
+			tune_note(c, &start);
+		}
+	}
+	pthread_mutex_unlock(&c->q_mutex);
+	return NULL;
+}
+
+/*
+ * Logs the current limit with its time since start (q_mutex held). A change that can't be logged is just not reported.
+ */
+static void tune_note(scan_ctx* c, struct timespec* start){
+	tune_event* tmp;
+	if (c->tune_len == c->tune_cap){
+		if ((tmp = realloc(c->tune_log, (c->tune_cap ? 2*c->tune_cap : 64) * sizeof(tune_event))) == NULL){
+			return;
+		}
+		c->tune_log = tmp;
+		c->tune_cap = c->tune_cap ? 2*c->tune_cap : 64;
+	}
+	c->tune_log[c->tune_len].seconds = ns_since(start) / 1e9;
+	c->tune_log[c->tune_len++].limit = c->limit;
+}
+
+/*
+ * Returns nanoseconds passed since start (CLOCK_MONOTONIC).
+ */
+static long ns_since(struct timespec* start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Adds a directory to queue: dir/name, or dir itself if name is NULL (root). ino is its inode number (for inode_order).
+ * parent is the subtree of the directory containing it, st the calling thread's counters (NULL for root).
+ * If threads are waiting on cond var, wakes one of them.
+ * Returns 0 on success, 1 otherwise.
+ * Only cancellation points in this function are prints which are made when all resorces have already been freed
+ */
+static int enque(scan_ctx* c, const char* dir, const char* name, ino_t ino, subtree* parent, counters* st){
+	node* n = make_node(dir, name);
+	if (n==NULL){
+		return 1;
+	}
+	n->parent = parent;
+	n->ino = ino;
+	if (q_lock(c, st)){ //failed acquiring mutex in enqueue
+		destroy_node(n);
+		fprintf(stderr,"error in enqueue mutex acquire");
+		return 1;
+	}
+	if (q_put(&c->q, n, c->opt.inode_order)){
+		pthread_mutex_unlock(&c->q_mutex);
+		destroy_node(n);
+		fprintf(stderr,"error growing queue\n");
+		return 1;
+	}
+	if (c->idle > 0 && pthread_cond_signal(&c->empty)){ //wake one waiter per item, not only when queue was empty
+		pthread_mutex_unlock(&c->q_mutex);//release taken lock
+		fprintf(stderr,"error in signaling");
+		return 1;
+	}
+	if (pthread_mutex_unlock(&c->q_mutex)){
+		fprintf(stderr,"error in enqueue mute release");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Puts node n in queue q (lock held): at the tail, or with inode_order in this sweep's heap if its inode is at or
+ * past the cursor and in the next sweep's heap otherwise.
+ * Returns 0 on success, 1 if a heap could not grow.
+ */
+static int q_put(queue* q, node* n, int inode_order){
+	int h, i, cap;
+	node** heap;
+	if (!inode_order){
+		if (q->tail == NULL){
+			q->head = n;
+		}
+		else{
+			q->tail->next = n;
+		}
+		q->tail = n;
+		q->len++;
+		return 0;
+	}
+	h = n->ino >= q->cursor ? q->cur : !q->cur;
+	if (q->heap_len[h] == q->heap_cap[h]){
+		cap = q->heap_cap[h] ? 2*q->heap_cap[h] : 256;
+		if ((heap = realloc(q->heap[h], cap * sizeof(node*))) == NULL){
+			return 1;
+		}
+		q->heap[h] = heap;
+		q->heap_cap[h] = cap;
+	}
+	heap = q->heap[h];
+	for (i = q->heap_len[h]++ ; i > 0 && heap[(i-1)/2]->ino > n->ino ; i = (i-1)/2){ //sift up
+		heap[i] = heap[(i-1)/2];
+	}
+	heap[i] = n;
+	q->len++;
+	return 0;
+}
+
+/*
+ * Takes the next node out of queue q (lock held, not empty): the head, or with inode_order the lowest inode of this
+ * sweep (starting the next sweep if this one is done).
+ */
+static node* q_take(queue* q, int inode_order){
+	int i, child, len;
+	node** heap, *n, *last;
+	q->len--;
+	if (!inode_order){
+		n = q->head;
+		q->head = n->next;
+		if (q->head == NULL){
+			q->tail = NULL;
+		}
+		return n;
+	}
+	if (q->heap_len[q->cur] == 0){ //sweep reached the end, go back to the start
+		q->cur = !q->cur;
+	}
+	heap = q->heap[q->cur];
+	n = heap[0];
+	len = --q->heap_len[q->cur];
+	last = heap[len];
+	for (i = 0 ; (child = 2*i+1) < len ; i = child){ //sift last item down from the top
+		if (child+1 < len && heap[child+1]->ino < heap[child]->ino){
+			child++;
+		}
+		if (heap[child]->ino >= last->ino){
+			break;
+		}
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+	q->cursor = n->ino;
+	return n;
+}
+
+/*
+ * Creates a list node containing directory path/dir (or path, if dir is NULL).
+ * On success returns pointer to node, on failure returns NULL
+ * Names are probably part of structs, so we will allocate new space for strings and copy them.
+ * There are no cancellation points in this function, except prints in errors which result in termination any way
+ */
+static node* make_node(const char* path, const char* dir){
+	node* n = calloc(1,sizeof(node));
+	size_t plen = strlen(path), dlen = dir != NULL ? strlen(dir) : 0;
+	if (n==NULL){
+		fprintf(stderr,"error in allocating new node\n");
+		return NULL;
+	}
+	n->name = malloc(plen + (dir != NULL ? dlen + 1 : 0) + 1); //full path (directory + / + direc) + null terminator
+	if (n->name == NULL){
+		free(n);
+		fprintf(stderr,"error in allocating new string - make node\n");
+		return NULL;
+	}
+	memcpy(n->name, path, plen); //copy path name
+	if (dir != NULL){
+		n->name[plen++] = '/'; //add / seperator
+		memcpy(n->name + plen, dir, dlen); //copy dir name
+	}
+	n->name[plen + dlen] = '\0';
+	return n;
+}
+
+/*
+ * Frees all allocated data associated with this node.
+ * note that any nodes pointed by this node will still be allocated.
+ */
+static void destroy_node(node* n){
+	free(n->name);
+	free(n);
+}
+
+/*
+ * Frees all allocated data in queue, and releases the subtrees its directories were pending in.
+ * Used when a scan was stopped (or its threads failed) and the queue is not empty
+ */
+static void destroy_q(scan_ctx* c){
+	node* cur, *nxt;
+	int h, i;
+	cur = (c->q.head);
+	while (cur != NULL){
+		nxt = cur->next;
+		subtree_drop(cur->parent);
+		destroy_node(cur);
+		cur = nxt;
+	}
+	for (h=0 ; h<2 ; h++){ //heaps are kept for the next run
+		for (i=0 ; i<c->q.heap_len[h] ; i++){
+			subtree_drop(c->q.heap[h][i]->parent);
+			destroy_node(c->q.heap[h][i]);
+		}
+		c->q.heap_len[h] = 0;
+	}
+	c->q.head = c->q.tail = NULL;
+	c->q.cursor = 0;
+	c->q.len = 0;
+}
+
+/*
+ * String hash (FNV-1a) for the extension tables.
+ */
+static unsigned long hash_name(const char* name){
+	unsigned long h = 14695981039346656037UL;
+	while (*name){
+		h = (h ^ (unsigned char)*name++) * 1099511628211UL;
+	}
+	return h;
+}
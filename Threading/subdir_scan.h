@@ -0,0 +1,94 @@
+/*
+ * subdir_scan.h
+ *
+ * Threaded directory scanner, the engine of distributed_subdir_size, as a library that can be embedded in process.
+ *
+ * Usage:
+ * 		scan_options o;
+ * 		scan_options_init(&o);
+ * 		o.threads = 8;
+ * 		o.callback = on_result; //called for every directory (and subtree with o.inclusive)
+ * 		scan_ctx* c = scan_create(&o);
+ * 		scan_exclude(c, ".snapshot");
+ * 		scan_run(c, "/data");
+ * 		scan_destroy(c);
+ *
+ * All state lives in the context, so several contexts can scan at the same time. One context runs one scan at a
+ * time, but it can be run again after scan_run returned (counters, aggregation and index records accumulate).
+ *
+ * The callback is called from the scanning thread that produced the result, with that thread's index
+ * (0..threads-1), so per thread state indexed by it needs no lock.
+ * scan_cancel stops a scan cooperatively: every thread finishes the directory it is on, and the directories that were
+ * still queued can be saved with scan_save_state and scanned later, in another context, with scan_resume.
+ * Errors are reported on stderr, like in the rest of the program.
+ */
+
+#ifndef SUBDIR_SCAN_H
+#define SUBDIR_SCAN_H
+
+#include <stdio.h>
+
+#define SCAN_DIR 0 //result types: files total size of a directory
+#define SCAN_SUBTREE 1 //inclusive size of a subtree (only with inclusive)
+#define SCAN_PRUNED_MATCH 1 //reasons a directory is left out: matched an exclude pattern
+#define SCAN_PRUNED_DEPTH 2 //deeper than max_depth
+
+typedef struct scan_ctx scan_ctx;
+
+/*
+ * Result callback. path is only valid during the call. Returning non zero stops the calling thread (as a failure).
+ */
+typedef int (*scan_cb)(void* arg, int thread, int type, const char* path, unsigned long size);
+
+typedef struct so{
+	int threads; //number of scanning threads (the maximum with auto_threads)
+	int inclusive; //aggregate subtree sizes, reported as SCAN_SUBTREE results
+	int disk_usage; //sum allocated bytes and count hard linked files once
+	int one_fs; //don't scan directories on other filesystems than root's
+	int max_depth; //don't scan directories more than this many levels below root, -1 for no limit
+	int aggregate; //keep file count and bytes by extension and by log2 size bucket
+	int auto_threads; //tune the number of threads actually scanning, between 1 and threads, while scanning
+	int inode_order; //stat entries and take queued directories by inode number (less seeking on cold rotational disks)
+	const char* index_path; //persistent scan index to reuse sizes of unchanged directories, NULL for none (not copied)
+	scan_cb callback; //may be NULL
+	void* arg; //passed to callback
+}scan_options;
+
+typedef struct ss{
+	unsigned long dirs;
+	unsigned long files;
+	unsigned long bytes;
+	unsigned long lock_wait_ns; //time spent acquiring the queue lock
+	unsigned long empty_wait_ns; //time spent waiting for a directory to be queued
+	unsigned long pruned_match; //sub directories left out by exclude patterns
+	unsigned long pruned_depth; //sub directories left out by max_depth
+	unsigned long pruned_mount; //directories on another filesystem
+	unsigned long ops; //metadata operations: directories opened and entries read
+	unsigned long op_ns; //time spent on them, op_ns / ops is the average metadata latency
+}scan_stats;
+
+void scan_options_init(scan_options* o);
+scan_ctx* scan_create(const scan_options* o);
+int scan_exclude(scan_ctx* c, const char* pattern);
+int scan_include(scan_ctx* c, const char* pattern);
+int scan_set_root(scan_ctx* c, const char* root);
+int scan_run(scan_ctx* c, const char* path);
+int scan_resume(scan_ctx* c, const char* path);
+int scan_save_state(scan_ctx* c, const char* path);
+void scan_cancel(scan_ctx* c);
+int scan_cancelled(scan_ctx* c);
+void scan_get_stats(scan_ctx* c, int thread, scan_stats* out);
+void scan_queue_state(scan_ctx* c, int* queued, int* idle, int* threads);
+int scan_thread_limit(scan_ctx* c);
+void scan_tune_report(scan_ctx* c, FILE* out);
+unsigned long scan_root_total(scan_ctx* c);
+unsigned long scan_hardlink_dups(scan_ctx* c);
+int scan_give_away(scan_ctx* c, void (*fn)(void* arg, const char* path), void* arg);
+int scan_level(scan_ctx* c, const char* path, unsigned long* size, int (*child)(void* arg, const char* path), void* arg);
+int scan_pruned(scan_ctx* c, const char* parent, const char* name);
+void scan_index_report(scan_ctx* c, FILE* out);
+int scan_index_save(scan_ctx* c);
+void scan_aggregate_report(scan_ctx* c, FILE* out);
+void scan_destroy(scan_ctx* c);
+
+#endif